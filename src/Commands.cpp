@@ -19,6 +19,9 @@ using namespace Microsoft::Cpp::BuildInsights;
 namespace vcperf
 {
 
+// names of huge template specializations can run to tens of kilobytes, which time traces don't need in full
+constexpr size_t MaxTimeTraceNameLength = 1024;
+
 const wchar_t* ResultCodeToString(RESULT_CODE rc)
 {
     switch (rc)
@@ -99,6 +102,12 @@ const wchar_t* ResultCodeToString(RESULT_CODE rc)
     return L"FAILURE_UNKNOWN_ERROR";
 }
 
+// split time traces are spread over several files, which can be found through the index
+std::filesystem::path GetTimeTraceNoticeFile(const std::filesystem::path& outputFile, const TimeTraceGenerator::Options& timeTraceOptions)
+{
+    return timeTraceOptions.IsSplit() ? TimeTraceGenerator::GetIndexFile(outputFile) : outputFile;
+}
+
 void PrintTraceStatistics(const TRACING_SESSION_STATISTICS& stats)
 {
     std::wcout << L"Dropped MSVC events: " << stats.MSVCEventsLost << std::endl;
@@ -225,16 +234,23 @@ RESULT_CODE StopToWPA(const std::wstring& sessionName, const std::filesystem::pa
 }
 
 RESULT_CODE StopToTimeTrace(const std::wstring& sessionName, const std::filesystem::path& outputFile, bool analyzeTemplates,
-    TRACING_SESSION_STATISTICS& statistics)
+    const TimeTraceGenerator::Options& timeTraceOptions, TRACING_SESSION_STATISTICS& statistics)
 {
     ExecutionHierarchy::Filter f{ analyzeTemplates,
                                   std::chrono::milliseconds(10),
-                                  std::chrono::milliseconds(10) };
+                                  std::chrono::milliseconds(10),
+                                  true,
+                                  MaxTimeTraceNameLength,
+                                  timeTraceOptions.AggregateIgnored,
+                                  timeTraceOptions.MaxIncludeDepth,
+                                  timeTraceOptions.MaxEntries };
     ExecutionHierarchy eh{ f };
-    TimeTraceGenerator ttg{ &eh, outputFile };
+    TimeTraceGenerator ttg{ &eh, outputFile, timeTraceOptions };
 
     auto analyzerGroup = MakeStaticAnalyzerGroup(&eh, &ttg);
-    int analysisPassCount = 1;
+
+    // a budget needs a first pass to measure durations
+    int analysisPassCount = f.MaxEntries > 0 ? 2 : 1;
 
     return StopAndAnalyzeTracingSession(sessionName.c_str(), analysisPassCount, &statistics, analyzerGroup);
 }
@@ -260,16 +276,24 @@ RESULT_CODE AnalyzeToWPA(const std::filesystem::path& inputFile, const std::file
         systemEventsRetentionFlags, analyzerGroup, reloggerGroup);
 }
 
-RESULT_CODE AnalyzeToTimeTrace(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, bool analyzeTemplates)
+RESULT_CODE AnalyzeToTimeTrace(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, bool analyzeTemplates,
+    const TimeTraceGenerator::Options& timeTraceOptions)
 {
     ExecutionHierarchy::Filter f{ analyzeTemplates,
                                   std::chrono::milliseconds(10),
-                                  std::chrono::milliseconds(10) };
+                                  std::chrono::milliseconds(10),
+                                  true,
+                                  MaxTimeTraceNameLength,
+                                  timeTraceOptions.AggregateIgnored,
+                                  timeTraceOptions.MaxIncludeDepth,
+                                  timeTraceOptions.MaxEntries };
     ExecutionHierarchy eh{ f };
-    TimeTraceGenerator ttg{ &eh, outputFile };
+    TimeTraceGenerator ttg{ &eh, outputFile, timeTraceOptions };
 
     auto analyzerGroup = MakeStaticAnalyzerGroup(&eh, &ttg);
-    int analysisPassCount = 1;
+
+    // a budget needs a first pass to measure durations
+    int analysisPassCount = f.MaxEntries > 0 ? 2 : 1;
 
     return Analyze(inputFile.c_str(), analysisPassCount, analyzerGroup);
 }
@@ -317,7 +341,8 @@ HRESULT DoStart(const std::wstring& sessionName, bool admin, bool cpuSampling, V
 }
 
 
-HRESULT DoStop(const std::wstring& sessionName, const std::filesystem::path& outputFile, bool analyzeTemplates, bool generateTimeTrace)
+HRESULT DoStop(const std::wstring& sessionName, const std::filesystem::path& outputFile, bool analyzeTemplates, bool generateTimeTrace,
+              const TimeTraceGenerator::Options& timeTraceOptions)
 {
     std::wcout << L"Stopping and analyzing tracing session " << sessionName << L"..." << std::endl;
 
@@ -327,7 +352,7 @@ HRESULT DoStop(const std::wstring& sessionName, const std::filesystem::path& out
         rc = StopToWPA(sessionName, outputFile, analyzeTemplates, statistics);
     }
     else {
-        rc = StopToTimeTrace(sessionName, outputFile, analyzeTemplates, statistics);
+        rc = StopToTimeTrace(sessionName, outputFile, analyzeTemplates, timeTraceOptions, statistics);
     }
 
     PrintTraceStatistics(statistics);
@@ -340,7 +365,7 @@ HRESULT DoStop(const std::wstring& sessionName, const std::filesystem::path& out
         return ResultCodeToHResult(rc);
     }
 
-    PrintPrivacyNotice(outputFile);
+    PrintPrivacyNotice(generateTimeTrace ? GetTimeTraceNoticeFile(outputFile, timeTraceOptions) : outputFile);
     std::wcout << L"Tracing session stopped successfully!" << std::endl;
 
     return S_OK;
@@ -370,7 +395,8 @@ HRESULT DoStopNoAnalyze(const std::wstring& sessionName, const std::filesystem::
     return S_OK;
 }
 
-HRESULT DoAnalyze(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, bool analyzeTemplates, bool generateTimeTrace)
+HRESULT DoAnalyze(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, bool analyzeTemplates, bool generateTimeTrace,
+                 const TimeTraceGenerator::Options& timeTraceOptions)
 {
     std::wcout << L"Analyzing..." << std::endl;
     
@@ -379,7 +405,7 @@ HRESULT DoAnalyze(const std::filesystem::path& inputFile, const std::filesystem:
         rc = AnalyzeToWPA(inputFile, outputFile, analyzeTemplates);
     }
     else {
-        rc = AnalyzeToTimeTrace(inputFile, outputFile, analyzeTemplates);
+        rc = AnalyzeToTimeTrace(inputFile, outputFile, analyzeTemplates, timeTraceOptions);
     }
 
     if (rc != RESULT_CODE_SUCCESS)
@@ -390,7 +416,7 @@ HRESULT DoAnalyze(const std::filesystem::path& inputFile, const std::filesystem:
         return ResultCodeToHResult(rc);
     }
 
-    PrintPrivacyNotice(outputFile);
+    PrintPrivacyNotice(generateTimeTrace ? GetTimeTraceNoticeFile(outputFile, timeTraceOptions) : outputFile);
     std::wcout << L"Analysis completed successfully!" << std::endl;
 
     return S_OK;
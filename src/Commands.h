@@ -3,6 +3,8 @@
 #include <filesystem>
 #include <string>
 
+#include "TimeTrace\TimeTraceGenerator.h"
+
 namespace vcperf
 {
 
@@ -15,9 +17,11 @@ enum class VerbosityLevel
 };
 
 HRESULT DoStart(const std::wstring& sessionName, bool admin, bool cpuSampling, VerbosityLevel verbosityLevel);
-HRESULT DoStop(const std::wstring& sessionName, const std::filesystem::path& outputFile, bool analyzeTemplates = false, bool generateTimeTrace = false);
+HRESULT DoStop(const std::wstring& sessionName, const std::filesystem::path& outputFile, bool analyzeTemplates = false, bool generateTimeTrace = false,
+              const TimeTraceGenerator::Options& timeTraceOptions = {});
 HRESULT DoStopNoAnalyze(const std::wstring& sessionName, const std::filesystem::path& outputFile);
-HRESULT DoAnalyze(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, bool analyzeTemplates = false, bool generateTimeTrace = false);
+HRESULT DoAnalyze(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, bool analyzeTemplates = false, bool generateTimeTrace = false,
+                 const TimeTraceGenerator::Options& timeTraceOptions = {});
 HRESULT DoGrantUserSessionControl();
 
 } // namespace vcperf
\ No newline at end of file
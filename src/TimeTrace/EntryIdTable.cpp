@@ -0,0 +1,108 @@
+#include "EntryIdTable.h"
+
+#include <assert.h>
+
+using namespace vcperf;
+
+namespace
+{
+    // always a power of two, so the hash can be masked instead of divided
+    constexpr size_t InitialCapacity = 1 << 10;
+
+    size_t Hash(unsigned long long id)
+    {
+        // instance ids are mostly consecutive: mix their bits so they spread through the table
+        id ^= id >> 33;
+        id *= 0xff51afd7ed558ccdULL;
+        id ^= id >> 33;
+
+        return static_cast<size_t>(id);
+    }
+
+}  // anonymous namespace
+
+EntryIdTable::EntryIdTable() :
+    slots_(InitialCapacity),
+    size_{0},
+    erasedSlots_{0}
+{
+}
+
+EntryIdTable::TIndex EntryIdTable::Find(unsigned long long id) const
+{
+    size_t slot = FindSlot(id);
+    return slots_[slot].Index == EmptySlot ? InvalidIndex : slots_[slot].Index;
+}
+
+void EntryIdTable::Insert(unsigned long long id, TIndex index)
+{
+    assert(index != InvalidIndex && index != ErasedSlot);
+    assert(Find(id) == InvalidIndex);
+
+    // keep the load factor (erased slots included) under 1/2, so probing sequences stay short
+    if ((size_ + erasedSlots_ + 1) * 2 > slots_.size()) {
+        Rehash((size_ + 1) * 2 > slots_.size() / 2 ? slots_.size() * 2 : slots_.size());
+    }
+
+    // reuse the first erased slot in the probing sequence, if any
+    size_t mask = slots_.size() - 1;
+    size_t slot = Hash(id) & mask;
+    while (slots_[slot].Index != EmptySlot && slots_[slot].Index != ErasedSlot) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (slots_[slot].Index == ErasedSlot) {
+        --erasedSlots_;
+    }
+
+    slots_[slot].Id = id;
+    slots_[slot].Index = index;
+    ++size_;
+}
+
+void EntryIdTable::Erase(unsigned long long id)
+{
+    size_t slot = FindSlot(id);
+    if (slots_[slot].Index == EmptySlot) {
+        return;
+    }
+
+    slots_[slot].Index = ErasedSlot;
+    --size_;
+    ++erasedSlots_;
+}
+
+size_t EntryIdTable::FindSlot(unsigned long long id) const
+{
+    // returns either the slot holding the id, or the empty one that ends its probing sequence
+    size_t mask = slots_.size() - 1;
+    size_t slot = Hash(id) & mask;
+    while (slots_[slot].Index != EmptySlot && (slots_[slot].Index == ErasedSlot || slots_[slot].Id != id)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void EntryIdTable::Rehash(size_t capacity)
+{
+    std::vector<Slot> previousSlots(capacity);
+    previousSlots.swap(slots_);
+
+    size_t mask = slots_.size() - 1;
+    for (const Slot& previousSlot : previousSlots)
+    {
+        if (previousSlot.Index == EmptySlot || previousSlot.Index == ErasedSlot) {
+            continue;
+        }
+
+        size_t slot = Hash(previousSlot.Id) & mask;
+        while (slots_[slot].Index != EmptySlot) {
+            slot = (slot + 1) & mask;
+        }
+
+        slots_[slot] = previousSlot;
+    }
+
+    erasedSlots_ = 0;
+}
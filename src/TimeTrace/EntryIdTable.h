@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace vcperf
+{
+
+// maps activity instance ids to dense entry indices, with open addressing (linear probing) over a single
+// flat array: no per-entry allocations, and lookups touch a single cache line most of the time
+class EntryIdTable
+{
+public:
+
+    typedef unsigned int TIndex;
+
+    static constexpr TIndex InvalidIndex = ~0U;
+
+public:
+
+    EntryIdTable();
+
+    // returns InvalidIndex when the id isn't present
+    TIndex Find(unsigned long long id) const;
+
+    // the id must not be present yet
+    void Insert(unsigned long long id, TIndex index);
+    void Erase(unsigned long long id);
+
+private:
+
+    struct Slot
+    {
+        unsigned long long Id = 0ULL;
+        TIndex Index = EmptySlot;
+    };
+
+    // erased slots can't be emptied, otherwise they'd break the probing sequence of whatever comes after them
+    static constexpr TIndex EmptySlot = ~0U;
+    static constexpr TIndex ErasedSlot = ~0U - 1;
+
+    size_t FindSlot(unsigned long long id) const;
+    void Rehash(size_t capacity);
+
+    std::vector<Slot> slots_;
+    size_t size_;
+    size_t erasedSlots_;
+};
+
+} // namespace vcperf
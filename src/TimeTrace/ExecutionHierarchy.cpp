@@ -4,6 +4,12 @@
 #include <assert.h>
 #include <string>
 
+#include "TimeTrace\LongNameWriter.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    #include <intrin.h>
+#endif
+
 using namespace Microsoft::Cpp::BuildInsights;
 using namespace Activities;
 using namespace SimpleEvents;
@@ -12,57 +18,149 @@ using namespace vcperf;
 
 namespace
 {
-    std::string ToString(const std::wstring& wstring)
+    std::string ToString(std::wstring_view wstring)
     {
         assert(!wstring.empty());
 
         const UINT codePage = CP_UTF8;
-        int requiredSize = WideCharToMultiByte(codePage, 0, wstring.c_str(), static_cast<int>(wstring.size()),
+        int requiredSize = WideCharToMultiByte(codePage, 0, wstring.data(), static_cast<int>(wstring.size()),
                                                NULL, 0, NULL, NULL);
         std::string convertedString = std::string(requiredSize, '\0');
-        WideCharToMultiByte(codePage, 0, wstring.c_str(), static_cast<int>(wstring.size()),
+        WideCharToMultiByte(codePage, 0, wstring.data(), static_cast<int>(wstring.size()),
                             &convertedString[0], requiredSize, NULL, NULL);
 
         return convertedString;
     }
 
-    long long ConvertTickPrecision(long long ticks, long long fromFreq, long long toFreq)
+    // 64-bit FNV-1a
+    unsigned long long HashName(std::string_view name)
     {
-        if (fromFreq <= 0) {
-            return 0;
+        unsigned long long hash = 14695981039346656037ULL;
+        for (char c : name)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
         }
 
-        long long p1 = (ticks / fromFreq) * toFreq;
-        long long p2 = (ticks % fromFreq) * toFreq / fromFreq;
+        return hash;
+    }
 
-        return p1 + p2;
+    // 64-bit FNV-1 (multiplying before mixing each byte in), to tell apart names whose FNV-1a is the same
+    unsigned long long HashNameAgain(std::string_view name)
+    {
+        unsigned long long hash = 14695981039346656037ULL;
+        for (char c : name)
+        {
+            hash *= 1099511628211ULL;
+            hash ^= static_cast<unsigned char>(c);
+        }
+
+        return hash;
     }
 
-    std::chrono::nanoseconds ConvertTime(long long ticks, long long frequency)
+    // FNV-1a, going on from the given hash, two bytes per character
+    unsigned long long HashWideString(std::wstring_view wstring, unsigned long long hash)
     {
-        return std::chrono::nanoseconds{ ConvertTickPrecision(ticks, frequency, std::chrono::nanoseconds::period::den) };
+        for (wchar_t c : wstring)
+        {
+            hash ^= static_cast<unsigned char>(c & 0xFF);
+            hash *= 1099511628211ULL;
+            hash ^= static_cast<unsigned char>((c >> 8) & 0xFF);
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
     }
 
-    unsigned int CountDigits(size_t number)
+    // whether the UTF-8 string is the prefix followed by the (UTF-16) wide string, without converting either
+    bool MatchesWideString(std::string_view utf8, std::string_view prefix, std::wstring_view wstring)
     {
-        unsigned int digits;
-        for (digits = 0; number > 0; ++digits)
+        if (utf8.substr(0, prefix.size()) != prefix) {
+            return false;
+        }
+        utf8.remove_prefix(prefix.size());
+
+        size_t position = 0;
+        for (size_t i = 0; i < utf8.size();)
         {
-            number /= 10;
+            unsigned char leadByte = static_cast<unsigned char>(utf8[i]);
+            size_t length = leadByte < 0x80 ? 1 : (leadByte & 0xE0) == 0xC0 ? 2 : (leadByte & 0xF0) == 0xE0 ? 3 : 4;
+            if (i + length > utf8.size()) {
+                return false;
+            }
+
+            unsigned int codePoint = length == 1 ? leadByte : leadByte & (0x7F >> length);
+            for (size_t j = 1; j < length; ++j) {
+                codePoint = (codePoint << 6) | (static_cast<unsigned char>(utf8[i + j]) & 0x3F);
+            }
+            i += length;
+
+            if (codePoint >= 0x10000)
+            {
+                codePoint -= 0x10000;
+                if (   position + 2 > wstring.size()
+                    || static_cast<unsigned int>(wstring[position]) != 0xD800 + (codePoint >> 10)
+                    || static_cast<unsigned int>(wstring[position + 1]) != 0xDC00 + (codePoint & 0x3FF))
+                {
+                    return false;
+                }
+                position += 2;
+            }
+            else
+            {
+                if (position >= wstring.size() || static_cast<unsigned int>(wstring[position]) != codePoint) {
+                    return false;
+                }
+                ++position;
+            }
         }
 
-        return digits;
+        return position == wstring.size();
+    }
+
+    // i.e. "std::vector<std::pair<...>>" -> "std::vector<std::pa... #0123456789abcdef"
+    constexpr std::string_view ShortenedNameSeparator = "... #";
+    constexpr size_t ShortenedNameSuffixLength = ShortenedNameSeparator.size() + 16;
+
+    unsigned long long GetThreadKey(const Activity& activity)
+    {
+        return (static_cast<unsigned long long>(activity.ProcessId()) << 32) | activity.ThreadId();
     }
 
-    std::string PrePadNumber(size_t number, char paddingCharacter, size_t totalExpectedLength)
+    // position of the highest bit set, value can't be 0
+    unsigned int GetHighestBit(unsigned long long value)
     {
-        std::string asPaddedString = std::to_string(number);
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+        unsigned long index = 0;
+        _BitScanReverse64(&index, value);
+        return static_cast<unsigned int>(index);
+#elif defined(__GNUC__) || defined(__clang__)
+        return 63U - static_cast<unsigned int>(__builtin_clzll(value));
+#else
+        unsigned int index = 0;
+        while (value >>= 1) {
+            ++index;
+        }
+        return index;
+#endif
+    }
 
-        if (asPaddedString.size() < totalExpectedLength) {
-            asPaddedString.insert(0, totalExpectedLength - asPaddedString.size(), paddingCharacter);
+    // i.e. "850 ms" or "1.8 s"
+    void AppendDuration(std::string& output, std::chrono::nanoseconds duration)
+    {
+        long long milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+        if (milliseconds < 1000)
+        {
+            output.append(std::to_string(milliseconds));
+            output.append(" ms");
+            return;
         }
 
-        return asPaddedString;
+        long long tenthsOfSecond = milliseconds / 100;
+        output.append(std::to_string(tenthsOfSecond / 10));
+        output.push_back('.');
+        output.append(std::to_string(tenthsOfSecond % 10));
+        output.append(" s");
     }
 
 }  // anonymous namespace
@@ -73,19 +171,87 @@ bool ExecutionHierarchy::Entry::OverlapsWith(const Entry* other) const
            other->StartTimestamp < StopTimestamp;
 }
 
+const std::string& ExecutionHierarchy::Entry::GetName(const SymbolNameStore& symbolNames, std::string& buffer) const
+{
+    if (SymbolName == SymbolNameStore::InvalidId) {
+        return Name;
+    }
+
+    symbolNames.GetName(SymbolName, buffer);
+    return buffer;
+}
+
 ExecutionHierarchy::ExecutionHierarchy(const Filter& filter) :
-    entries_{},
+    entryBlocks_{},
+    entryCount_{0},
+    releasedEntries_{},
+    entryIndices_{},
+    releaseStack_{},
     roots_{},
+    layout_{},
     filter_{filter},
-    fileInputsOutputsPerInvocation_{},
+    strings_{},
     symbolNames_{},
-    unresolvedTemplateInstantiationsPerSymbol_{}
+    wideStringIds_{},
+    tickConverter_{},
+    ignoreTemplateInstantiationUnderTicks_{0LL},
+    ignoreFunctionUnderTicks_{0LL},
+    analysisPass_{0},
+    functionDurations_{},
+    templateInstantiationDurations_{},
+    fixedEntryCount_{0ULL},
+    templateInstantiationCountPerThread_{},
+    candidateParentPerThread_{},
+    longNames_{},
+    longNameWriter_{nullptr},
+    shortenedName_{},
+    fileInputsOutputsPerInvocation_{},
+    unresolvedTemplateInstantiationsPerSymbol_{},
+    subscribedSymbolsPerThread_{},
+    pendingTemplateInstantiationsPerThread_{},
+    openAggregatesPerParent_{},
+    nextAggregateId_{~0ULL},
+    includeDepths_{},
+    collapsedFiles_{}
+{
+    // shortened names always end with the hash, so they can't get any shorter than that
+    if (filter_.MaxNameLength > 0) {
+        filter_.MaxNameLength = std::max(filter_.MaxNameLength, ShortenedNameSuffixLength);
+    }
+}
+
+AnalysisControl ExecutionHierarchy::OnBeginAnalysisPass()
 {
+    analysisPass_++;
+    return AnalysisControl::CONTINUE;
+}
+
+AnalysisControl ExecutionHierarchy::OnEndAnalysisPass()
+{
+    if (IsMeasuringPass()) {
+        ApplyBudget();
+    }
+
+    return AnalysisControl::CONTINUE;
 }
 
 AnalysisControl ExecutionHierarchy::OnStartActivity(const EventStack& eventStack)
 {
-    if (   MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnNestedActivity)
+    // all events in a trace share the same tick frequency, and the first one to start is where the trace starts
+    if (tickConverter_.GetFrequency() == 0) {
+        SetTickConverter(eventStack.Back().TickFrequency(), eventStack.Back().StartTimestamp());
+    }
+
+    // durations are only known once activities finish
+    if (IsMeasuringPass()) {
+        return AnalysisControl::CONTINUE;
+    }
+
+    // functions and template instantiations may not get an entry right away, and files may not get one at all (see Filter)
+    if (   MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnStartFrontEndFile)
+        || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnStartFunction)
+        || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnStartTemplateInstantiation)
+        || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnNestedActivity)
         || MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnRootActivity))
     {}
 
@@ -99,12 +265,24 @@ AnalysisControl ExecutionHierarchy::OnStartActivity(const EventStack& eventStack
 
 AnalysisControl ExecutionHierarchy::OnStopActivity(const EventStack& eventStack)
 {
+    if (IsMeasuringPass())
+    {
+        if (   MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnMeasureFunction)
+            || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnMeasureTemplateInstantiation)
+            || MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnMeasureActivity))
+        {}
+
+        return AnalysisControl::CONTINUE;
+    }
+
     MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnFinishActivity);
 
     // apply filtering
     if (   MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnFinishInvocation)
         || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnFinishFunction)
-        || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnFinishTemplateInstantiation))
+        || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnFinishTemplateInstantiation)
+        || MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnFinishFrontEndFile)
+        || MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnFinishFrontEndPass))
     {}
 
     return AnalysisControl::CONTINUE;
@@ -112,6 +290,10 @@ AnalysisControl ExecutionHierarchy::OnStopActivity(const EventStack& eventStack)
 
 AnalysisControl ExecutionHierarchy::OnSimpleEvent(const EventStack& eventStack)
 {
+    if (IsMeasuringPass()) {
+        return AnalysisControl::CONTINUE;
+    }
+
     if (   MatchEventInMemberFunction(eventStack.Back(), this, &ExecutionHierarchy::OnSymbolName)
         || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnCommandLine)
         || MatchEventStackInMemberFunction(eventStack, this, &ExecutionHierarchy::OnEnvironmentVariable)
@@ -122,125 +304,368 @@ AnalysisControl ExecutionHierarchy::OnSimpleEvent(const EventStack& eventStack)
     return AnalysisControl::CONTINUE;
 }
 
+AnalysisControl ExecutionHierarchy::OnEndAnalysis()
+{
+    // entries that never finished may still have tombstones among their children
+    for (TEntryIndex index = 0; index < entryCount_; ++index)
+    {
+        Entry& entry = EntryAt(index);
+        if (entry.TombstoneCount > 0) {
+            RemoveTombstones(entry);
+        }
+    }
+
+    return AnalysisControl::CONTINUE;
+}
+
 const ExecutionHierarchy::Entry* ExecutionHierarchy::GetEntry(unsigned long long id) const
 {
-    auto it = entries_.find(id);
-    return it != entries_.end() ? &it->second : nullptr;
+    TEntryIndex index = entryIndices_.Find(id);
+    return index != EntryIdTable::InvalidIndex ? GetEntryAt(index) : nullptr;
+}
+
+ExecutionHierarchy::Entry* ExecutionHierarchy::FindEntry(unsigned long long id)
+{
+    TEntryIndex index = entryIndices_.Find(id);
+    return index != EntryIdTable::InvalidIndex ? &EntryAt(index) : nullptr;
+}
+
+void ExecutionHierarchy::Layout::Clear()
+{
+    Ids.clear();
+    ProcessIds.clear();
+    ThreadIds.clear();
+    StartTimestamps.clear();
+    StopTimestamps.clear();
+    SubtreeSizes.clear();
+    EntryIndices.clear();
+    Roots.clear();
+}
+
+void ExecutionHierarchy::Finalize()
+{
+    layout_.Clear();
+
+    for (const Entry* root : roots_) {
+        Flatten(root, layout_);
+    }
+}
+
+void ExecutionHierarchy::Flatten(const Entry* root, Layout& layout) const
+{
+    auto append = [this, &layout](TEntryIndex index)
+    {
+        const Entry* entry = GetEntryAt(index);
+
+        layout.Ids.push_back(entry->Id);
+        layout.ProcessIds.push_back(entry->ProcessId);
+        layout.ThreadIds.push_back(entry->ThreadId);
+        layout.StartTimestamps.push_back(entry->StartTimestamp);
+        layout.StopTimestamps.push_back(entry->StopTimestamp);
+        layout.SubtreeSizes.push_back(1);
+        layout.EntryIndices.push_back(index);
+
+        return layout.Size() - 1;
+    };
+
+    layout.Roots.push_back(append(entryIndices_.Find(root->Id)));
+
+    // explicit stack, as recursing down deep subtrees could overflow the call stack: the position of each
+    // entry we're in, along with the next of its children to visit
+    std::vector<std::pair<size_t, size_t>> openEntries{ { layout.Roots.back(), 0 } };
+    while (!openEntries.empty())
+    {
+        std::pair<size_t, size_t>& openEntry = openEntries.back();
+        const Entry* entry = GetEntryAt(layout.EntryIndices[openEntry.first]);
+
+        if (openEntry.second == entry->Children.size())
+        {
+            layout.SubtreeSizes[openEntry.first] = static_cast<TEntryIndex>(layout.Size() - openEntry.first);
+            openEntries.pop_back();
+            continue;
+        }
+
+        // entries that never finished may still have tombstones
+        TEntryIndex childIndex = entry->Children[openEntry.second++];
+        if (childIndex != InvalidEntryIndex) {
+            openEntries.emplace_back(append(childIndex), 0);
+        }
+    }
+}
+
+void ExecutionHierarchy::ReleaseRoot(const Entry* root)
+{
+    auto itRoot = std::find(roots_.begin(), roots_.end(), root);
+    assert(itRoot != roots_.end());
+
+    roots_.erase(itRoot);
+    ReleaseEntry(entryIndices_.Find(root->Id));
 }
 
 void ExecutionHierarchy::OnRootActivity(const Activity& root)
 {
-    Entry* entry = CreateEntry(root);
-    
+    const Entry* entry = GetEntryAt(CreateEntry(root));
+
     assert(std::find(roots_.begin(), roots_.end(), entry) == roots_.end());
     roots_.push_back(entry);
 }
 
 void ExecutionHierarchy::OnNestedActivity(const Activity& parent, const Activity& child)
 {
-    auto parentEntryIt = entries_.find(parent.EventInstanceId());
-    assert(parentEntryIt != entries_.end());
-
-    Entry* childEntry = CreateEntry(child);
+    TEntryIndex parentIndex = FindParentIndex(parent.EventInstanceId());
+    assert(parentIndex != InvalidEntryIndex);
 
-    auto& children = parentEntryIt->second.Children;
-    assert(std::find(children.begin(), children.end(), childEntry) == children.end());
-    children.push_back(childEntry);
+    AddChild(parentIndex, CreateEntry(child));
 }
 
 void ExecutionHierarchy::OnFinishActivity(const Activity& activity)
 {
-    auto it = entries_.find(activity.EventInstanceId());
-    assert(it != entries_.end());
+    // may not have an entry (see Filter)
+    TEntryIndex index = entryIndices_.Find(activity.EventInstanceId());
+    if (index != InvalidEntryIndex)
+    {
+        Entry& entry = EntryAt(index);
+        entry.StopTimestamp = activity.StopTimestamp();
+
+        // no more children can come or go, so leave them ready for the TimeTraceGenerator
+        if (entry.TombstoneCount > 0) {
+            RemoveTombstones(entry);
+        }
+
+        if (!openAggregatesPerParent_.empty()) {
+            openAggregatesPerParent_.erase(index);
+        }
+    }
+}
+
+ExecutionHierarchy::TEntryIndex ExecutionHierarchy::FindParentIndex(unsigned long long parentId) const
+{
+    TEntryIndex index = entryIndices_.Find(parentId);
+    if (index != InvalidEntryIndex || collapsedFiles_.empty()) {
+        return index;
+    }
 
-    it->second.StopTimestamp = ConvertTime(activity.StopTimestamp(), activity.TickFrequency());
+    auto itCollapsed = collapsedFiles_.find(parentId);
+    return itCollapsed != collapsedFiles_.end() ? entryIndices_.Find(itCollapsed->second.AggregateId) : InvalidEntryIndex;
+}
+
+ExecutionHierarchy::TEntryIndex ExecutionHierarchy::CreateEntry(const Activity& activity)
+{
+    return CreateEntry(activity.EventInstanceId(), activity.ProcessId(), activity.ThreadId(),
+                       activity.StartTimestamp(), activity.StopTimestamp(), activity.EventName());
 }
 
-ExecutionHierarchy::Entry* ExecutionHierarchy::CreateEntry(const Activity& activity)
+ExecutionHierarchy::TEntryIndex ExecutionHierarchy::CreateEntry(unsigned long long id, unsigned long processId, unsigned long threadId,
+                                                                long long startTimestamp, long long stopTimestamp,
+                                                                std::string_view name)
 {
-    assert(entries_.find(activity.EventInstanceId()) == entries_.end());
+    assert(FindEntry(id) == nullptr);
+
+    TEntryIndex index;
+    if (!releasedEntries_.empty())
+    {
+        index = releasedEntries_.back();
+        releasedEntries_.pop_back();
+    }
+    else
+    {
+        assert(entryCount_ < EntryIdTable::InvalidIndex - 1);
+
+        index = entryCount_++;
+        if (index / EntryBlockSize == entryBlocks_.size()) {
+            entryBlocks_.push_back(std::make_unique<Entry[]>(EntryBlockSize));
+        }
+    }
+
+    entryIndices_.Insert(id, index);
+
+    Entry& entry = EntryAt(index);
+
+    entry.Id = id;
+    entry.ProcessId = processId;
+    entry.ThreadId = threadId;
+    entry.StartTimestamp = startTimestamp;
+    entry.StopTimestamp = stopTimestamp;
+    entry.Name = name;
+
+    return index;
+}
+
+void ExecutionHierarchy::AddChild(TEntryIndex parentIndex, TEntryIndex childIndex)
+{
+    std::vector<TEntryIndex>& children = EntryAt(parentIndex).Children;
+    Entry& child = EntryAt(childIndex);
+    assert(child.Parent == InvalidEntryIndex);
+
+    // children must stay sorted by start time: entries created when they finish may need to go before
+    // some siblings, although they usually don't (tombstones can go anywhere)
+    size_t position = children.size();
+    for (size_t i = children.size(); i > 0; --i)
+    {
+        TEntryIndex sibling = children[i - 1];
+        if (sibling == InvalidEntryIndex) {
+            continue;
+        }
+
+        if (GetEntryAt(sibling)->StartTimestamp <= child.StartTimestamp) {
+            break;
+        }
+
+        position = i - 1;
+    }
 
-    Entry& entry = entries_[activity.EventInstanceId()];
+    children.insert(children.begin() + position, childIndex);
 
-    entry.Id = activity.EventInstanceId();
-    entry.ProcessId = activity.ProcessId();
-    entry.ThreadId = activity.ThreadId();
-    entry.StartTimestamp = ConvertTime(activity.StartTimestamp(), activity.TickFrequency());
-    entry.StopTimestamp = ConvertTime(activity.StopTimestamp(), activity.TickFrequency());
-    entry.Name = activity.EventName();
+    child.Parent = parentIndex;
+    child.PositionInParent = static_cast<unsigned int>(position);
 
-    return &entry;
+    for (size_t i = position + 1; i < children.size(); ++i)
+    {
+        if (children[i] != InvalidEntryIndex) {
+            EntryAt(children[i]).PositionInParent = static_cast<unsigned int>(i);
+        }
+    }
+}
+
+void ExecutionHierarchy::RemoveTombstones(Entry& entry)
+{
+    // stable, so children stay sorted
+    size_t position = 0;
+    for (TEntryIndex child : entry.Children)
+    {
+        if (child != InvalidEntryIndex)
+        {
+            EntryAt(child).PositionInParent = static_cast<unsigned int>(position);
+            entry.Children[position++] = child;
+        }
+    }
+
+    entry.Children.resize(position);
+    entry.TombstoneCount = 0;
 }
 
 void ExecutionHierarchy::OnInvocation(const Invocation& invocation)
 {
-    auto it = entries_.find(invocation.EventInstanceId());
-    assert(it != entries_.end());
+    Entry* entry = FindEntry(invocation.EventInstanceId());
+    assert(entry != nullptr);
 
     // may not be present, as it's not available in earlier versions of the toolset
     if (invocation.ToolPath()) {
-        it->second.Properties.try_emplace("Tool Path", ToString(invocation.ToolPath()));
+        AddProperty(entry, "Tool Path", Intern(invocation.ToolPath()));
     }
 
-    it->second.Properties.try_emplace("Working Directory", ToString(invocation.WorkingDirectory()));
-    it->second.Properties.try_emplace("Tool Version", invocation.ToolVersionString());
+    AddProperty(entry, "Working Directory", Intern(invocation.WorkingDirectory()));
+    AddProperty(entry, "Tool Version", invocation.ToolVersionString());
 
     if (invocation.EventId() == EVENT_ID_COMPILER) {
-        it->second.Name = "CL Invocation " + std::to_string(invocation.InvocationId());
+        entry->Name = "CL Invocation " + std::to_string(invocation.InvocationId());
     }
     else if (invocation.EventId() == EVENT_ID_LINKER) {
-        it->second.Name = "Link Invocation " + std::to_string(invocation.InvocationId());
+        entry->Name = "Link Invocation " + std::to_string(invocation.InvocationId());
     }
 }
 
 void ExecutionHierarchy::OnFrontEndFile(const FrontEndFile& frontEndFile)
 {
-    auto it = entries_.find(frontEndFile.EventInstanceId());
-    assert(it != entries_.end());
-    it->second.Name = frontEndFile.Path();
+    // may be past the include depth cap (see Filter)
+    Entry* entry = FindEntry(frontEndFile.EventInstanceId());
+    if (entry != nullptr) {
+        entry->Name = frontEndFile.Path();
+    }
 }
 
 void ExecutionHierarchy::OnThread(const Activity& parent, const Thread& thread)
 {
-    auto it = entries_.find(thread.EventInstanceId());
-    assert(it != entries_.end());
-    it->second.Name = std::string(parent.EventName()) + std::string(thread.EventName());
+    Entry* entry = FindEntry(thread.EventInstanceId());
+    assert(entry != nullptr);
+    entry->Name = std::string(parent.EventName()) + std::string(thread.EventName());
+}
+
+void ExecutionHierarchy::OnStartFrontEndFile(const Activity& parent, const FrontEndFile& frontEndFile)
+{
+    if (filter_.MaxIncludeDepth == 0)
+    {
+        OnNestedActivity(parent, frontEndFile);
+        return;
+    }
+
+    // nested in a file past the cap, so it's past the cap as well
+    auto itCollapsedParent = collapsedFiles_.find(parent.EventInstanceId());
+    if (itCollapsedParent != collapsedFiles_.end())
+    {
+        collapsedFiles_.emplace(frontEndFile.EventInstanceId(), CollapsedFile{ itCollapsedParent->second.AggregateId, InvalidEntryIndex });
+        return;
+    }
+
+    // the translation unit itself comes right under the FrontEndPass
+    auto itParentDepth = includeDepths_.find(parent.EventInstanceId());
+    unsigned int depth = itParentDepth != includeDepths_.end() ? itParentDepth->second + 1 : 1;
+    if (depth <= filter_.MaxIncludeDepth)
+    {
+        includeDepths_.emplace(frontEndFile.EventInstanceId(), depth);
+        OnNestedActivity(parent, frontEndFile);
+        return;
+    }
+
+    TEntryIndex parentIndex = entryIndices_.Find(parent.EventInstanceId());
+    assert(parentIndex != InvalidEntryIndex);
+
+    TEntryIndex aggregateIndex = JoinAggregate(parentIndex, AggregateKind::INCLUDE, frontEndFile);
+    collapsedFiles_.emplace(frontEndFile.EventInstanceId(), CollapsedFile{ EntryAt(aggregateIndex).Id, parentIndex });
+}
+
+void ExecutionHierarchy::OnStartFunction(const Activity& parent, const Function& function)
+{
+    // when deferred, the entry gets created in OnFinishFunction
+    if (!filter_.DeferEntryCreation) {
+        OnNestedActivity(parent, function);
+    }
+}
+
+void ExecutionHierarchy::OnStartTemplateInstantiation(const Activity& parent, const TemplateInstantiationGroup& templateInstantiationGroup)
+{
+    // not tracked at all unless requested
+    if (!filter_.AnalyzeTemplates) {
+        return;
+    }
+
+    const Activity& parentActivity = templateInstantiationGroup.Size() == 1 ? parent : templateInstantiationGroup[templateInstantiationGroup.Size() - 2];
+    const TemplateInstantiation& templateInstantiation = templateInstantiationGroup.Back();
+
+    if (!filter_.DeferEntryCreation)
+    {
+        OnNestedActivity(parentActivity, templateInstantiation);
+        return;
+    }
+
+    TPendingTemplateInstantiations& pending = pendingTemplateInstantiationsPerThread_[GetThreadKey(templateInstantiation)];
+    assert(templateInstantiationGroup.Size() > 1 || pending.empty());
+
+    PendingTemplateInstantiation& record = pending.emplace_back();
+    record.Id = templateInstantiation.EventInstanceId();
+    record.ParentId = parentActivity.EventInstanceId();
+    record.ProcessId = templateInstantiation.ProcessId();
+    record.ThreadId = templateInstantiation.ThreadId();
+    record.StartTimestamp = templateInstantiation.StartTimestamp();
 }
 
 void ExecutionHierarchy::OnFinishInvocation(const Invocation& invocation)
 {
-    // store every FileInput and FileOutput as properties
+    // store all FileInputs and FileOutputs as a list property each, in the order they came in
     auto itFileInputsOutputs = fileInputsOutputsPerInvocation_.find(invocation.EventInstanceId());
     if (itFileInputsOutputs != fileInputsOutputsPerInvocation_.end())
     {
-        auto itInvocation = entries_.find(invocation.EventInstanceId());
-        assert(itInvocation != entries_.end());
+        Entry* invocationEntry = FindEntry(invocation.EventInstanceId());
+        assert(invocationEntry != nullptr);
 
-        Entry& invocationEntry = itInvocation->second;
-        const TFileInputsOutputs& data = itFileInputsOutputs->second;
+        TFileInputsOutputs& data = itFileInputsOutputs->second;
 
-        // FileInputs
-        if (data.first.size() == 1) {
-            invocationEntry.Properties.try_emplace("File Input", data.first[0]);
-        }
-        else
-        {
-            const size_t totalDigits = CountDigits(data.first.size());
-            for (size_t i = 0; i < data.first.size(); ++i) {
-                invocationEntry.Properties.try_emplace("File Input #" + PrePadNumber(i, '0', totalDigits), data.first[i]);
-            }
+        if (!data.first.empty()) {
+            AddProperty(invocationEntry, "File Inputs", std::move(data.first));
         }
 
-        // FileOutputs
-        if (data.second.size() == 1) {
-            invocationEntry.Properties.try_emplace("File Output", data.second[0]);
-        }
-        else
-        {
-            const size_t totalDigits = CountDigits(data.second.size());
-            for (size_t i = 0; i < data.second.size(); ++i) {
-                invocationEntry.Properties.try_emplace("File Output #" + PrePadNumber(i, '0', totalDigits), data.second[i]);
-            }
+        if (!data.second.empty()) {
+            AddProperty(invocationEntry, "File Outputs", std::move(data.second));
         }
 
         fileInputsOutputsPerInvocation_.erase(invocation.EventInstanceId());
@@ -250,77 +675,216 @@ void ExecutionHierarchy::OnFinishInvocation(const Invocation& invocation)
 void ExecutionHierarchy::OnFinishFunction(const Activity& parent, const Function& function)
 {
     // filter by duration
-    auto durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(function.Duration());
-    if (durationMs < filter_.IgnoreFunctionUnderMs) {
-        IgnoreEntry(function.EventInstanceId(), parent.EventInstanceId());
+    long long durationTicks = function.StopTimestamp() - function.StartTimestamp();
+    if (durationTicks < ignoreFunctionUnderTicks_)
+    {
+        // when deferred, there's no entry to ignore
+        if (!filter_.DeferEntryCreation) {
+            IgnoreEntry(function.EventInstanceId());
+        }
+
+        if (filter_.AggregateIgnored)
+        {
+            TEntryIndex parentIndex = entryIndices_.Find(parent.EventInstanceId());
+            assert(parentIndex != InvalidEntryIndex);
+
+            JoinAggregate(parentIndex, AggregateKind::FUNCTION, function);
+            AddAggregateTime(parentIndex, function);
+        }
+    }
+    else if (filter_.DeferEntryCreation)
+    {
+        TEntryIndex parentIndex = entryIndices_.Find(parent.EventInstanceId());
+        assert(parentIndex != InvalidEntryIndex);
+
+        TEntryIndex index = CreateEntry(function);
+        EntryAt(index).Name = ShortenName(function.Name());
+        AddChild(parentIndex, index);
     }
     else
     {
-        auto it = entries_.find(function.EventInstanceId());
-        assert(it != entries_.end());
-        it->second.Name = function.Name();
+        Entry* entry = FindEntry(function.EventInstanceId());
+        assert(entry != nullptr);
+        entry->Name = ShortenName(function.Name());
     }
 }
 
 void ExecutionHierarchy::OnFinishTemplateInstantiation(const A::Activity& parent, const A::TemplateInstantiationGroup& templateInstantiationGroup)
 {
-    const A::Activity& parentActivity = templateInstantiationGroup.Size() == 1 ? parent : templateInstantiationGroup[templateInstantiationGroup.Size() - 2];
-
+    // not tracked at all unless requested
     if (!filter_.AnalyzeTemplates) {
-        IgnoreEntry(templateInstantiationGroup.Back().EventInstanceId(), parentActivity.EventInstanceId());
+        return;
+    }
+
+    if (filter_.DeferEntryCreation) {
+        OnFinishPendingTemplateInstantiation(templateInstantiationGroup);
     }
     else
     {
         // keep full hierarchy when root passes filter, even if children wouldn't pass
         // we can only know root's Duration when it finishes: checking it when a child finishes will result in 0ns
-        if (templateInstantiationGroup.Size() == 1 &&
-            std::chrono::duration_cast<std::chrono::milliseconds>(templateInstantiationGroup.Front().Duration()) < filter_.IgnoreTemplateInstantiationUnderMs)
+        const TemplateInstantiation& root = templateInstantiationGroup.Front();
+        if (templateInstantiationGroup.Size() == 1 && root.StopTimestamp() - root.StartTimestamp() < ignoreTemplateInstantiationUnderTicks_)
         {
             // ignores root TemplateInstantiation and its children (don't clear their symbol subscriptions, we'll deal with missing subscribers in OnSymbolName)
-            IgnoreEntry(templateInstantiationGroup.Back().EventInstanceId(), parentActivity.EventInstanceId());
+            IgnoreEntry(templateInstantiationGroup.Back().EventInstanceId());
+
+            if (filter_.AggregateIgnored)
+            {
+                TEntryIndex parentIndex = FindParentIndex(parent.EventInstanceId());
+                assert(parentIndex != InvalidEntryIndex);
+
+                JoinAggregate(parentIndex, AggregateKind::TEMPLATE_INSTANTIATION, root);
+                AddAggregateTime(parentIndex, root);
+            }
         }
         else
         {
-            // get us subscribed for name resolution (may already have some other activities following)
-            auto result = unresolvedTemplateInstantiationsPerSymbol_.try_emplace(templateInstantiationGroup.Back().SpecializationSymbolKey(),
-                                                                                 TUnresolvedTemplateInstantiationNames());
-            result.first->second.push_back(templateInstantiationGroup.Back().EventInstanceId());
+            const TemplateInstantiation& templateInstantiation = templateInstantiationGroup.Back();
+            SubscribeForName(GetThreadKey(templateInstantiation), templateInstantiation.SpecializationSymbolKey(),
+                             templateInstantiation.EventInstanceId());
         }
     }
 }
 
+void ExecutionHierarchy::OnFinishPendingTemplateInstantiation(const A::TemplateInstantiationGroup& templateInstantiationGroup)
+{
+    const TemplateInstantiation& templateInstantiation = templateInstantiationGroup.Back();
+    TPendingTemplateInstantiations& pending = pendingTemplateInstantiationsPerThread_[GetThreadKey(templateInstantiation)];
+
+    auto itRecord = std::find_if(pending.rbegin(), pending.rend(), [&templateInstantiation](const PendingTemplateInstantiation& record) {
+        return record.Id == templateInstantiation.EventInstanceId();
+    });
+    assert(itRecord != pending.rend());
+
+    itRecord->StopTimestamp = templateInstantiation.StopTimestamp();
+    itRecord->SymbolKey = templateInstantiation.SpecializationSymbolKey();
+
+    // the whole group gets decided once its root finishes
+    if (templateInstantiationGroup.Size() > 1) {
+        return;
+    }
+
+    // keep full hierarchy when root passes filter, even if children wouldn't pass
+    if (templateInstantiation.StopTimestamp() - templateInstantiation.StartTimestamp() >= ignoreTemplateInstantiationUnderTicks_)
+    {
+        for (const PendingTemplateInstantiation& record : pending)
+        {
+            TEntryIndex parentIndex = FindParentIndex(record.ParentId);
+            assert(parentIndex != InvalidEntryIndex);
+
+            AddChild(parentIndex, CreateEntry(record.Id, record.ProcessId, record.ThreadId, record.StartTimestamp, record.StopTimestamp,
+                                              templateInstantiation.EventName()));
+
+            SubscribeForName(GetThreadKey(templateInstantiation), record.SymbolKey, record.Id);
+        }
+    }
+    else if (filter_.AggregateIgnored)
+    {
+        // the root's record comes first
+        TEntryIndex parentIndex = FindParentIndex(pending.front().ParentId);
+        assert(parentIndex != InvalidEntryIndex);
+
+        JoinAggregate(parentIndex, AggregateKind::TEMPLATE_INSTANTIATION, templateInstantiation);
+        AddAggregateTime(parentIndex, templateInstantiation);
+    }
+
+    // keeps its capacity for the thread's next root instantiation
+    pending.clear();
+}
+
+void ExecutionHierarchy::OnFinishFrontEndFile(const FrontEndFile& frontEndFile)
+{
+    if (filter_.MaxIncludeDepth == 0) {
+        return;
+    }
+
+    auto itCollapsed = collapsedFiles_.find(frontEndFile.EventInstanceId());
+    if (itCollapsed == collapsedFiles_.end())
+    {
+        includeDepths_.erase(frontEndFile.EventInstanceId());
+        return;
+    }
+
+    // files nested in it are already part of its time
+    if (itCollapsed->second.AggregateParentIndex != InvalidEntryIndex) {
+        AddAggregateTime(itCollapsed->second.AggregateParentIndex, frontEndFile);
+    }
+
+    collapsedFiles_.erase(itCollapsed);
+}
+
+void ExecutionHierarchy::OnFinishFrontEndPass(const FrontEndPass& frontEndPass)
+{
+    auto itSubscribed = subscribedSymbolsPerThread_.find(GetThreadKey(frontEndPass));
+    if (itSubscribed == subscribedSymbolsPerThread_.end()) {
+        return;
+    }
+
+    // resolved symbols already unsubscribed, this only finds the ones that never got a name
+    for (TSymbolKey symbolKey : itSubscribed->second) {
+        unresolvedTemplateInstantiationsPerSymbol_.erase(symbolKey);
+    }
+
+    // keeps its capacity for the thread's next FrontEndPass
+    itSubscribed->second.clear();
+}
+
+void ExecutionHierarchy::SubscribeForName(unsigned long long threadKey, TSymbolKey symbolKey, unsigned long long id)
+{
+    // may already have some other activities following
+    auto result = unresolvedTemplateInstantiationsPerSymbol_.try_emplace(symbolKey, TUnresolvedTemplateInstantiationNames());
+    if (result.second) {
+        subscribedSymbolsPerThread_[threadKey].push_back(symbolKey);
+    }
+
+    result.first->second.push_back(id);
+}
+
 void ExecutionHierarchy::OnSymbolName(const SymbolName& symbolName)
 {
     // SymbolName events get executed after all TemplateInstantiation in the same FrontEndPass take place
     // and we're sure to have exclusive keys for these symbols (they may have matching names between
-    // FrontEndPass activities, but their key is unique for the trace)
-    assert(symbolNames_.find(symbolName.Key()) == symbolNames_.end());
-    std::string& name = symbolNames_[symbolName.Key()];
-    name = symbolName.Name();
+    // FrontEndPass activities, but their key is unique for the trace), so there's no need to keep names around
+    // once subscribed activities know about them
 
     // now we've resolved the name, let subscribed activities know
     auto itSubscribedForSymbol = unresolvedTemplateInstantiationsPerSymbol_.find(symbolName.Key());
     if (itSubscribedForSymbol != unresolvedTemplateInstantiationsPerSymbol_.end())
     {
+        // all entries share the same copy of the name
+        SymbolNameStore::TNameId nameId = SymbolNameStore::InvalidId;
+
         for (unsigned long long id : itSubscribedForSymbol->second)
         {
-            auto itEntry = entries_.find(id);
+            Entry* entry = FindEntry(id);
 
             // may've been filtered out (didn't clean up this subscription when filtering happened, as we're cleaning them all in a bit)
-            if (itEntry != entries_.end()) {
-                itEntry->second.Name = name;
+            if (entry == nullptr) {
+                continue;
+            }
+
+            assert(entry->SymbolName == SymbolNameStore::InvalidId);
+            if (nameId == SymbolNameStore::InvalidId) {
+                nameId = symbolNames_.Add(ShortenName(symbolName.Name()));
+            }
+            else {
+                symbolNames_.AddReference(nameId);
             }
+
+            entry->Name.clear();
+            entry->SymbolName = nameId;
         }
-        itSubscribedForSymbol->second.clear();
+        unresolvedTemplateInstantiationsPerSymbol_.erase(itSubscribedForSymbol);
     }
 }
 
 void ExecutionHierarchy::OnCommandLine(const Activity& parent, const CommandLine& commandLine)
 {
-    auto it = entries_.find(parent.EventInstanceId());
-    assert(it != entries_.end());
+    Entry* entry = FindEntry(parent.EventInstanceId());
+    assert(entry != nullptr);
 
-    it->second.Properties.try_emplace("Command Line", ToString(commandLine.Value()));
+    AddProperty(entry, "Command Line", Intern(commandLine.Value()));
 }
 
 void ExecutionHierarchy::OnEnvironmentVariable(const Activity& parent, const EnvironmentVariable& environmentVariable)
@@ -346,10 +910,10 @@ void ExecutionHierarchy::OnEnvironmentVariable(const Activity& parent, const Env
 
     if (process)
     {
-        auto it = entries_.find(parent.EventInstanceId());
-        assert(it != entries_.end());
+        Entry* entry = FindEntry(parent.EventInstanceId());
+        assert(entry != nullptr);
         
-        it->second.Properties.try_emplace("Env Var: " + ToString(environmentVariable.Name()), ToString(environmentVariable.Value()));
+        AddProperty(entry, strings_.GetString(Intern(environmentVariable.Name(), "Env Var: ")), Intern(environmentVariable.Value()));
     }
 }
 
@@ -367,7 +931,7 @@ void ExecutionHierarchy::OnFileInput(const Invocation& parent, const FileInput&
         return;
     }
 
-    inputsOutputsPair.first.push_back(ToString(path));
+    inputsOutputsPair.first.push_back(Intern(path));
 }
 
 void ExecutionHierarchy::OnFileOutput(const Invocation& parent, const FileOutput& fileOutput)
@@ -376,36 +940,383 @@ void ExecutionHierarchy::OnFileOutput(const Invocation& parent, const FileOutput
     auto result = fileInputsOutputsPerInvocation_.try_emplace(parent.EventInstanceId(), TFileInputs(), TFileOutputs());
     auto& inputsOutputsPair = result.first->second;
 
-    inputsOutputsPair.second.push_back(ToString(fileOutput.Path()));
+    inputsOutputsPair.second.push_back(Intern(fileOutput.Path()));
 }
 
-void ExecutionHierarchy::IgnoreEntry(unsigned long long id, unsigned long long parentId)
+void ExecutionHierarchy::IgnoreEntry(unsigned long long id)
 {
+    TEntryIndex index = entryIndices_.Find(id);
+    if (index == InvalidEntryIndex) {
+        return;
+    }
+
     // ensure parent no longer points to it
-    auto itParent = entries_.find(parentId);
-    assert(itParent != entries_.end());
+    const Entry& entry = EntryAt(index);
+    if (entry.Parent != InvalidEntryIndex)
+    {
+        Entry& parent = EntryAt(entry.Parent);
+        std::vector<TEntryIndex>& children = parent.Children;
+        assert(children[entry.PositionInParent] == index);
+
+        // usually the last child, which can go right away (along with any tombstones it leaves exposed)
+        if (entry.PositionInParent + 1 == children.size())
+        {
+            children.pop_back();
+            while (!children.empty() && children.back() == InvalidEntryIndex)
+            {
+                children.pop_back();
+                --parent.TombstoneCount;
+            }
+        }
+        else
+        {
+            children[entry.PositionInParent] = InvalidEntryIndex;
+            ++parent.TombstoneCount;
+        }
+    }
+
+    // ignore it and its children (no need to let intermediate parents know, as they'll be erased as well)
+    ReleaseEntry(index);
+}
+
+ExecutionHierarchy::TEntryIndex ExecutionHierarchy::JoinAggregate(TEntryIndex parentIndex, AggregateKind kind, const Activity& activity)
+{
+    // only while nothing else came in after it
+    auto itAggregate = openAggregatesPerParent_.find(parentIndex);
+    const std::vector<TEntryIndex>& siblings = EntryAt(parentIndex).Children;
+    if (   itAggregate != openAggregatesPerParent_.end() && itAggregate->second.Kind == kind
+        && !siblings.empty() && siblings.back() == itAggregate->second.Index)
+    {
+        ++itAggregate->second.Count;
+        return itAggregate->second.Index;
+    }
+
+    TEntryIndex index = CreateEntry(nextAggregateId_--, activity.ProcessId(), activity.ThreadId(),
+                                    activity.StartTimestamp(), activity.StartTimestamp(), std::string_view{});
+    AddChild(parentIndex, index);
+
+    openAggregatesPerParent_[parentIndex] = Aggregate{ index, kind, 1U, 0LL };
+    return index;
+}
+
+void ExecutionHierarchy::AddAggregateTime(TEntryIndex parentIndex, const Activity& activity)
+{
+    auto itAggregate = openAggregatesPerParent_.find(parentIndex);
+    assert(itAggregate != openAggregatesPerParent_.end());
+
+    Aggregate& aggregate = itAggregate->second;
+    aggregate.DurationTicks += activity.StopTimestamp() - activity.StartTimestamp();
+
+    Entry& entry = EntryAt(aggregate.Index);
+    entry.StopTimestamp = activity.StopTimestamp();
+
+    // nothing else gets nested in it until the next activity joins
+    if (entry.TombstoneCount > 0) {
+        RemoveTombstones(entry);
+    }
+
+    // i.e. "312 functions < 10 ms (1.8 s)", thresholds may come from a budget rather than the filter
+    entry.Name = std::to_string(aggregate.Count);
+    switch (aggregate.Kind)
+    {
+    case AggregateKind::FUNCTION:
+        entry.Name.append(aggregate.Count == 1 ? " function < " : " functions < ");
+        AppendDuration(entry.Name, tickConverter_.ToNanoseconds(ignoreFunctionUnderTicks_));
+        break;
+
+    case AggregateKind::TEMPLATE_INSTANTIATION:
+        entry.Name.append(aggregate.Count == 1 ? " template instantiation < " : " template instantiations < ");
+        AppendDuration(entry.Name, tickConverter_.ToNanoseconds(ignoreTemplateInstantiationUnderTicks_));
+        break;
+
+    case AggregateKind::INCLUDE:
+        entry.Name.append(aggregate.Count == 1 ? " include past depth " : " includes past depth ");
+        entry.Name.append(std::to_string(filter_.MaxIncludeDepth));
+        break;
+    }
+
+    entry.Name.append(" (");
+    AppendDuration(entry.Name, tickConverter_.ToNanoseconds(aggregate.DurationTicks));
+    entry.Name.push_back(')');
+}
+
+void ExecutionHierarchy::SetTickConverter(long long tickFrequency, long long startTimestamp)
+{
+    tickConverter_ = TickConverter{ tickFrequency, startTimestamp };
+
+    // thresholds are whole milliseconds, so durations reach them in ticks exactly when they do in milliseconds
+    ignoreTemplateInstantiationUnderTicks_ = tickConverter_.FromNanoseconds(filter_.IgnoreTemplateInstantiationUnderMs);
+    ignoreFunctionUnderTicks_ = tickConverter_.FromNanoseconds(filter_.IgnoreFunctionUnderMs);
+}
+
+void ExecutionHierarchy::OnMeasureFunction(const Activity& parent, const Function& function)
+{
+    // with aggregates, every entry may get one right after it
+    functionDurations_.Add(function.StopTimestamp() - function.StartTimestamp(), filter_.AggregateIgnored ? 2ULL : 1ULL);
+    MeasureCandidateParent(parent);
+}
+
+void ExecutionHierarchy::OnMeasureTemplateInstantiation(const Activity& parent, const TemplateInstantiationGroup& templateInstantiationGroup)
+{
+    // not tracked at all unless requested
+    if (!filter_.AnalyzeTemplates) {
+        return;
+    }
+
+    // the whole hierarchy goes with its root, which finishes last
+    unsigned long long& count = templateInstantiationCountPerThread_[GetThreadKey(templateInstantiationGroup.Back())];
+    ++count;
+
+    if (templateInstantiationGroup.Size() > 1) {
+        return;
+    }
+
+    const TemplateInstantiation& root = templateInstantiationGroup.Front();
+    templateInstantiationDurations_.Add(root.StopTimestamp() - root.StartTimestamp(), filter_.AggregateIgnored ? count + 1 : count);
+    count = 0ULL;
+
+    MeasureCandidateParent(parent);
+}
 
-    std::vector<Entry*>& children = itParent->second.Children;
-    auto itEntryAsChildren = std::find_if(children.begin(), children.end(), [&id](const Entry* child) {
-        return child->Id == id;
+void ExecutionHierarchy::OnMeasureActivity(const Activity&)
+{
+    // anything else gets an entry no matter how long it takes (files past the include depth cap included, which
+    // makes the estimate err on the safe side)
+    ++fixedEntryCount_;
+}
+
+void ExecutionHierarchy::MeasureCandidateParent(const Activity& parent)
+{
+    if (!filter_.AggregateIgnored) {
+        return;
+    }
+
+    // besides one after every entry, an aggregate may come first among its siblings: counting every time the
+    // parent changes on a thread may count some parents twice (i.e. when an include finishes), never too few
+    unsigned long long& parentId = candidateParentPerThread_[GetThreadKey(parent)];
+    if (parentId != parent.EventInstanceId())
+    {
+        parentId = parent.EventInstanceId();
+        ++fixedEntryCount_;
+    }
+}
+
+void ExecutionHierarchy::ApplyBudget()
+{
+    const std::vector<unsigned long long>& functionCounts = functionDurations_.EntryCounts;
+    const std::vector<unsigned long long>& templateInstantiationCounts = templateInstantiationDurations_.EntryCounts;
+
+    // right past the longest ones, for when none fit
+    size_t functionBucket = functionCounts.size();
+    while (functionBucket > 0 && functionCounts[functionBucket - 1] == 0 && templateInstantiationCounts[functionBucket - 1] == 0) {
+        --functionBucket;
+    }
+
+    size_t templateInstantiationBucket = functionBucket;
+
+    // longest first, both going down the buckets together until either doesn't fit anymore (the other one
+    // can still take that last bucket, if it fits)
+    unsigned long long budget = filter_.MaxEntries > fixedEntryCount_ ? filter_.MaxEntries - fixedEntryCount_ : 0ULL;
+    for (size_t bucket = functionBucket; bucket > 0; --bucket)
+    {
+        bool functionsFit = functionCounts[bucket - 1] <= budget;
+        if (functionsFit)
+        {
+            budget -= functionCounts[bucket - 1];
+            functionBucket = bucket - 1;
+        }
+
+        bool templateInstantiationsFit = templateInstantiationCounts[bucket - 1] <= budget;
+        if (templateInstantiationsFit)
+        {
+            budget -= templateInstantiationCounts[bucket - 1];
+            templateInstantiationBucket = bucket - 1;
+        }
+
+        if (!functionsFit || !templateInstantiationsFit) {
+            break;
+        }
+    }
+
+    ignoreFunctionUnderTicks_ = DurationHistogram::GetBucketStart(functionBucket);
+    ignoreTemplateInstantiationUnderTicks_ = DurationHistogram::GetBucketStart(templateInstantiationBucket);
+}
+
+void ExecutionHierarchy::DurationHistogram::Add(long long durationTicks, unsigned long long entryCount)
+{
+    EntryCounts[GetBucket(durationTicks)] += entryCount;
+}
+
+size_t ExecutionHierarchy::DurationHistogram::GetBucket(long long durationTicks)
+{
+    // exact under 2^SubBucketBits, and then the highest bit picks the group of buckets and the ones right after
+    // it the bucket in there
+    if (durationTicks < (1LL << SubBucketBits)) {
+        return durationTicks > 0 ? static_cast<size_t>(durationTicks) : 0;
+    }
+
+    unsigned int highestBit = GetHighestBit(static_cast<unsigned long long>(durationTicks));
+    size_t subBucket = static_cast<size_t>(durationTicks >> (highestBit - SubBucketBits)) & ((1 << SubBucketBits) - 1);
+
+    return (static_cast<size_t>(highestBit - SubBucketBits + 1) << SubBucketBits) | subBucket;
+}
+
+long long ExecutionHierarchy::DurationHistogram::GetBucketStart(size_t bucket)
+{
+    if (bucket < (1 << SubBucketBits)) {
+        return static_cast<long long>(bucket);
+    }
+
+    unsigned int highestBit = static_cast<unsigned int>(bucket >> SubBucketBits) + SubBucketBits - 1;
+    long long subBucket = static_cast<long long>(bucket & ((1 << SubBucketBits) - 1));
+
+    return ((1LL << SubBucketBits) + subBucket) << (highestBit - SubBucketBits);
+}
+
+std::string_view ExecutionHierarchy::ShortenName(std::string_view name)
+{
+    if (filter_.MaxNameLength == 0 || name.size() <= filter_.MaxNameLength) {
+        return name;
+    }
+
+    // the hash has to stay the same between runs (and machines), so the name can be looked up later on: it only
+    // depends on the name, unless another one got there first, in which case it moves on to the next free value
+    // (the same one every time, for the same trace), so each hash in the names file stands for a single name
+    const LongNameCheck check{ name.size(), HashNameAgain(name) };
+    unsigned long long hash = HashName(name);
+    for (;;)
+    {
+        auto result = longNames_.try_emplace(hash, check);
+        if (result.second)
+        {
+            if (longNameWriter_ != nullptr) {
+                longNameWriter_->Add(hash, name);
+            }
+            break;
+        }
+
+        if (result.first->second.Length == check.Length && result.first->second.Hash == check.Hash) {
+            break;
+        }
+
+        ++hash;
+    }
+
+    size_t prefixLength = filter_.MaxNameLength - ShortenedNameSuffixLength;
+
+    // don't cut in the middle of a UTF-8 sequence
+    while (prefixLength > 0 && (static_cast<unsigned char>(name[prefixLength]) & 0xC0) == 0x80) {
+        --prefixLength;
+    }
+
+    shortenedName_.assign(name.data(), prefixLength);
+    shortenedName_.append(ShortenedNameSeparator);
+    AppendNameHash(shortenedName_, hash);
+
+    return shortenedName_;
+}
+
+void ExecutionHierarchy::AppendNameHash(std::string& output, unsigned long long hash)
+{
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        output.push_back("0123456789abcdef"[(hash >> shift) & 0xF]);
+    }
+}
+
+void ExecutionHierarchy::AddProperty(Entry* entry, std::string_view key, std::string_view value)
+{
+    AddProperty(entry, key, strings_.Intern(value));
+}
+
+void ExecutionHierarchy::AddProperty(Entry* entry, std::string_view key, StringInterner::TStringId value)
+{
+    auto it = FindPropertyPosition(entry, key);
+    if (it != entry->Properties.end() && strings_.GetString(it->Key) == key) {
+        return;
+    }
+
+    entry->Properties.insert(it, Property{ strings_.Intern(key), value, false });
+}
+
+void ExecutionHierarchy::AddProperty(Entry* entry, std::string_view key, TPropertyList&& values)
+{
+    auto it = FindPropertyPosition(entry, key);
+    if (it != entry->Properties.end() && strings_.GetString(it->Key) == key) {
+        return;
+    }
+
+    entry->Properties.insert(it, Property{ strings_.Intern(key), static_cast<StringInterner::TStringId>(entry->PropertyLists.size()), true });
+    entry->PropertyLists.push_back(std::move(values));
+}
+
+ExecutionHierarchy::TProperties::iterator ExecutionHierarchy::FindPropertyPosition(Entry* entry, std::string_view key)
+{
+    return std::lower_bound(entry->Properties.begin(), entry->Properties.end(), key, [this](const Property& property, std::string_view searchedKey) {
+        return strings_.GetString(property.Key) < searchedKey;
     });
-    assert(itEntryAsChildren != children.end());
+}
 
-    children.erase(itEntryAsChildren);
+StringInterner::TStringId ExecutionHierarchy::Intern(std::wstring_view value, std::string_view prefix)
+{
+    unsigned long long hash = HashWideString(value, HashName(prefix));
 
-    // ignore it and its children (no need to let intermediate parents know, as they'll be erased as well)
-    IgnoreEntry(id);
+    // only a match if the string it stands for really is this one, rather than another with the same hash
+    auto it = wideStringIds_.find(hash);
+    if (it != wideStringIds_.end() && MatchesWideString(strings_.GetString(it->second), prefix, value)) {
+        return it->second;
+    }
+
+    std::string convertedValue{ prefix };
+    if (!value.empty()) {
+        convertedValue += ToString(value);
+    }
+
+    // on a collision, the string that came first keeps the hash, and this one gets converted every time
+    StringInterner::TStringId id = strings_.Intern(convertedValue);
+    wideStringIds_.emplace(hash, id);
+
+    return id;
 }
 
-void ExecutionHierarchy::IgnoreEntry(unsigned long long id)
+void ExecutionHierarchy::ReleaseEntry(TEntryIndex index)
 {
-    auto itEntry = entries_.find(id);
-    if (itEntry != entries_.end())
+    releaseStack_.push_back(index);
+
+    while (!releaseStack_.empty())
     {
-        for (const Entry* child : itEntry->second.Children) {
-            IgnoreEntry(child->Id);
+        TEntryIndex current = releaseStack_.back();
+        releaseStack_.pop_back();
+
+        Entry& entry = EntryAt(current);
+        for (TEntryIndex child : entry.Children)
+        {
+            if (child != InvalidEntryIndex) {
+                releaseStack_.push_back(child);
+            }
+        }
+
+        entryIndices_.Erase(entry.Id);
+
+        // aggregates don't finish like activities do, so the ones nested in them only stop being open here, and
+        // must not outlive the slot: whatever takes it next would extend and rename them
+        if (!openAggregatesPerParent_.empty()) {
+            openAggregatesPerParent_.erase(current);
         }
 
-        entries_.erase(itEntry);
+        // clear rather than reset, so the next entry to take this slot reuses the allocated memory
+        entry.Name.clear();
+        if (entry.SymbolName != SymbolNameStore::InvalidId)
+        {
+            symbolNames_.Release(entry.SymbolName);
+            entry.SymbolName = SymbolNameStore::InvalidId;
+        }
+        entry.Children.clear();
+        entry.Properties.clear();
+        entry.PropertyLists.clear();
+        entry.Parent = InvalidEntryIndex;
+        entry.PositionInParent = 0U;
+        entry.TombstoneCount = 0U;
+
+        releasedEntries_.push_back(current);
     }
 }
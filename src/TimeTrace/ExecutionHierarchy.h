@@ -1,53 +1,157 @@
 #pragma once
 
+#include <memory>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <chrono>
 
 #include "VcperfBuildInsights.h"
+#include "TimeTrace\EntryIdTable.h"
+#include "TimeTrace\StringInterner.h"
+#include "TimeTrace\SymbolNameStore.h"
+#include "TimeTrace\TickConverter.h"
 
 namespace vcperf
 {
 
+class LongNameWriter;
+
 class ExecutionHierarchy : public BI::IAnalyzer
 {
 public:
 
-    // controls which activities get ignored
+    // controls which activities get ignored, and how much of them gets kept
     struct Filter
     {
         bool AnalyzeTemplates = false;
         std::chrono::milliseconds IgnoreTemplateInstantiationUnderMs = std::chrono::milliseconds(0);
         std::chrono::milliseconds IgnoreFunctionUnderMs = std::chrono::milliseconds(0);
+
+        // most functions and template instantiations don't pass the filter: when set, they only become
+        // entries once they're known to pass it, instead of getting created and then ignored
+        bool DeferEntryCreation = false;
+
+        // function and template instantiation names can get huge: past this length (0 means no limit), entries
+        // only keep the beginning of their name along with a hash of it, and full names go to the LongNameWriter, if any
+        // (limits too short to hold the hash count as the shortest one that does)
+        size_t MaxNameLength = 0;
+
+        // when set, functions and template instantiations that don't pass the filter aren't just dropped: consecutive
+        // siblings collapse into a single entry instead, i.e. "312 functions < 10 ms (1.8 s)", so their time still shows
+        bool AggregateIgnored = false;
+
+        // files included deeper than this (0 means no limit, the translation unit itself is at depth 1) don't get
+        // entries of their own: consecutive ones collapse into a single entry, i.e. "57 includes past depth 4 (1.2 s)",
+        // which takes whatever was nested in them
+        unsigned int MaxIncludeDepth = 0U;
+
+        // when set (0 means no budget), the thresholds above make way for the lowest ones that keep the hierarchy
+        // within about this many entries, keeping the longest functions and template instantiations: it takes an
+        // extra analysis pass beforehand, which only measures how long they take
+        size_t MaxEntries = 0;
     };
 
+    // entries live in a slab (see GetEntryAt), and refer to each other through their dense index in it
+    typedef EntryIdTable::TIndex TEntryIndex;
+    static constexpr TEntryIndex InvalidEntryIndex = EntryIdTable::InvalidIndex;
+
+    // both key and value are interned (see GetStrings)
+    // list properties (i.e. "File Inputs") have their values in the entry's PropertyLists, and Value is their index there
+    struct Property
+    {
+        StringInterner::TStringId Key = 0U;
+        StringInterner::TStringId Value = 0U;
+        bool IsList = false;
+    };
+
+    // kept sorted by key
+    typedef std::vector<Property> TProperties;
+    typedef std::vector<StringInterner::TStringId> TPropertyList;
+
     struct Entry
     {
         unsigned long long Id = 0L;
         unsigned long ProcessId = 0L;
         unsigned long ThreadId = 0L;
-        std::chrono::nanoseconds StartTimestamp = std::chrono::nanoseconds(0);
-        std::chrono::nanoseconds StopTimestamp = std::chrono::nanoseconds(0);
+        // raw ticks, as they come in the trace (see GetTickConverter)
+        long long StartTimestamp = 0LL;
+        long long StopTimestamp = 0LL;
         std::string Name;
+        // template instantiations keep their name in the hierarchy's store instead (see GetSymbolNames)
+        SymbolNameStore::TNameId SymbolName = SymbolNameStore::InvalidId;
+
+        std::vector<TEntryIndex> Children;
+        TProperties Properties;
+        std::vector<TPropertyList> PropertyLists;
 
-        std::vector<Entry*> Children;
-        std::unordered_map<std::string, std::string> Properties;
+        // back-link into the parent's Children (InvalidEntryIndex for roots), so ignoring an entry doesn't
+        // need to search for it: it leaves a tombstone there instead, cleared when the parent finishes
+        TEntryIndex Parent = InvalidEntryIndex;
+        unsigned int PositionInParent = 0U;
+        unsigned int TombstoneCount = 0U;
 
         bool OverlapsWith(const Entry* other) const;
+
+        // buffer only gets used (and needs to outlive the result) for names kept in the store
+        const std::string& GetName(const SymbolNameStore& symbolNames, std::string& buffer) const;
     };
 
     typedef std::vector<const Entry*> TRoots;
 
+    // the finished hierarchy, flattened in pre-order (i.e. the order entries get written in) as one array per
+    // field, so walking it only touches what's needed: an entry's subtree is [i, i + SubtreeSizes[i]), and its
+    // first child, if any, comes right after it
+    struct Layout
+    {
+        std::vector<unsigned long long> Ids;
+        std::vector<unsigned long> ProcessIds;
+        std::vector<unsigned long> ThreadIds;
+        std::vector<long long> StartTimestamps;
+        std::vector<long long> StopTimestamps;
+        std::vector<TEntryIndex> SubtreeSizes;
+
+        // where the entry lives in the slab, for its name and properties
+        std::vector<TEntryIndex> EntryIndices;
+
+        // positions of the roots, in the same order as GetRoots
+        std::vector<size_t> Roots;
+
+        inline size_t Size() const { return Ids.size(); }
+        void Clear();
+    };
+
 public:
 
     ExecutionHierarchy(const Filter& filter);
 
+    BI::AnalysisControl OnBeginAnalysisPass() override;
+    BI::AnalysisControl OnEndAnalysisPass() override;
     BI::AnalysisControl OnStartActivity(const BI::EventStack& eventStack) override;
     BI::AnalysisControl OnStopActivity(const BI::EventStack& eventStack) override;
     BI::AnalysisControl OnSimpleEvent(const BI::EventStack& eventStack) override;
+    BI::AnalysisControl OnEndAnalysis() override;
 
     const Entry* GetEntry(unsigned long long id) const;
+    inline const Entry* GetEntryAt(TEntryIndex index) const { return &entryBlocks_[index / EntryBlockSize][index % EntryBlockSize]; }
     inline const TRoots& GetRoots() const { return roots_; }
+    inline const StringInterner& GetStrings() const { return strings_; }
+    inline const SymbolNameStore& GetSymbolNames() const { return symbolNames_; }
+    // only known once the first activity comes in
+    inline const TickConverter& GetTickConverter() const { return tickConverter_; }
+    // gets the full names of the entries that got a shortened one, the first time each one does (see Filter)
+    inline void SetLongNameWriter(LongNameWriter* longNameWriter) { longNameWriter_ = longNameWriter; }
+    // as 16 hex digits, the way it shows up in shortened names
+    static void AppendNameHash(std::string& output, unsigned long long hash);
+
+    // lays out all roots once analysis is over (see GetLayout), and flattens a single root for those who
+    // don't wait for the end
+    void Finalize();
+    void Flatten(const Entry* root, Layout& layout) const;
+    inline const Layout& GetLayout() const { return layout_; }
+
+    // frees a finished root along with all its entries, i.e. once it's been written out
+    void ReleaseRoot(const Entry* root);
 
 private:
 
@@ -55,15 +159,41 @@ private:
     void OnNestedActivity(const A::Activity& parent, const A::Activity& child);
     void OnFinishActivity(const A::Activity& activity);
 
-    Entry* CreateEntry(const A::Activity& activity);
+    // files past the include depth cap don't have entries, so what's nested in them goes to their aggregate
+    TEntryIndex FindParentIndex(unsigned long long parentId) const;
+
+    inline Entry& EntryAt(TEntryIndex index) { return entryBlocks_[index / EntryBlockSize][index % EntryBlockSize]; }
+    Entry* FindEntry(unsigned long long id);
+    TEntryIndex CreateEntry(const A::Activity& activity);
+    TEntryIndex CreateEntry(unsigned long long id, unsigned long processId, unsigned long threadId,
+                            long long startTimestamp, long long stopTimestamp, std::string_view name);
+    void AddChild(TEntryIndex parentIndex, TEntryIndex childIndex);
+    void RemoveTombstones(Entry& entry);
+    void ReleaseEntry(TEntryIndex index);
+
+    // does nothing if the entry already has a property with this key
+    void AddProperty(Entry* entry, std::string_view key, std::string_view value);
+    void AddProperty(Entry* entry, std::string_view key, StringInterner::TStringId value);
+    void AddProperty(Entry* entry, std::string_view key, TPropertyList&& values);
+    TProperties::iterator FindPropertyPosition(Entry* entry, std::string_view key);
+
+    // converts to UTF-8 and interns, after the given prefix if any, only converting each distinct string once
+    StringInterner::TStringId Intern(std::wstring_view value, std::string_view prefix = {});
 
     void OnInvocation(const A::Invocation& invocation);
     void OnFrontEndFile(const A::FrontEndFile& frontEndFile);
     void OnThread(const A::Activity& parent, const A::Thread& thread);
+    void OnStartFrontEndFile(const A::Activity& parent, const A::FrontEndFile& frontEndFile);
+    void OnStartFunction(const A::Activity& parent, const A::Function& function);
+    void OnStartTemplateInstantiation(const A::Activity& parent, const A::TemplateInstantiationGroup& templateInstantiationGroup);
 
     void OnFinishInvocation(const A::Invocation& invocation);
     void OnFinishFunction(const A::Activity& parent, const A::Function& function);
     void OnFinishTemplateInstantiation(const A::Activity& parent, const A::TemplateInstantiationGroup& templateInstantiationGroup);
+    void OnFinishPendingTemplateInstantiation(const A::TemplateInstantiationGroup& templateInstantiationGroup);
+    void OnFinishFrontEndFile(const A::FrontEndFile& frontEndFile);
+    void OnFinishFrontEndPass(const A::FrontEndPass& frontEndPass);
+    void SubscribeForName(unsigned long long threadKey, unsigned long long symbolKey, unsigned long long id);
 
     void OnSymbolName(const SE::SymbolName& symbolName);
     void OnCommandLine(const A::Activity& parent, const SE::CommandLine& commandLine);
@@ -71,22 +201,156 @@ private:
     void OnFileInput(const A::Invocation& parent, const SE::FileInput& fileInput);
     void OnFileOutput(const A::Invocation& parent, const SE::FileOutput& fileOutput);
 
-    void IgnoreEntry(unsigned long long id, unsigned long long parentId);
     void IgnoreEntry(unsigned long long id);
 
-    std::unordered_map<unsigned long long, Entry> entries_;
+    // entries standing for several consecutive siblings (see Filter)
+    enum class AggregateKind
+    {
+        FUNCTION,
+        TEMPLATE_INSTANTIATION,
+        INCLUDE
+    };
+
+    // counts the activity in its parent's last child when that's an aggregate of the same kind, or starts a new one
+    TEntryIndex JoinAggregate(TEntryIndex parentIndex, AggregateKind kind, const A::Activity& activity);
+    // once the activity that joined last finishes
+    void AddAggregateTime(TEntryIndex parentIndex, const A::Activity& activity);
+
+    void SetTickConverter(long long tickFrequency, long long startTimestamp);
+
+    // the pass before the real one when there's a budget (see Filter)
+    inline bool IsMeasuringPass() const { return filter_.MaxEntries > 0 && analysisPass_ == 1; }
+    void OnMeasureFunction(const A::Activity& parent, const A::Function& function);
+    void OnMeasureTemplateInstantiation(const A::Activity& parent, const A::TemplateInstantiationGroup& templateInstantiationGroup);
+    void OnMeasureActivity(const A::Activity& activity);
+    void MeasureCandidateParent(const A::Activity& parent);
+    void ApplyBudget();
+
+    std::string_view ShortenName(std::string_view name);
+
+    // fixed-size blocks never move once allocated, so entries don't either; released entries get reused
+    // as they are (keeping their strings' and containers' capacity), which saves most allocations
+    static constexpr TEntryIndex EntryBlockSize = 4096;
+    std::vector<std::unique_ptr<Entry[]>> entryBlocks_;
+    TEntryIndex entryCount_;
+    std::vector<TEntryIndex> releasedEntries_;
+    EntryIdTable entryIndices_;
+    // explicit stack for ReleaseEntry, as recursing down deep subtrees could overflow the call stack
+    std::vector<TEntryIndex> releaseStack_;
+
     TRoots roots_;
+    Layout layout_;
     Filter filter_;
+    StringInterner strings_;
+    SymbolNameStore symbolNames_;
+
+    // paths, command lines and environment variables come as wide strings, and the same ones show up again
+    // and again between invocations: they're looked up by a 64-bit hash of them, prefix included, and checked
+    // against the interned UTF-8 string, so no wide copy has to stick around
+    // only invocations have such properties, and the filter never drops those, so converting them as they come
+    // in costs nothing that waiting for the export would save
+    std::unordered_map<unsigned long long, StringInterner::TStringId> wideStringIds_;
+
+    // timestamps stay in ticks until they get written, so the filter's thresholds get converted instead
+    TickConverter tickConverter_;
+    long long ignoreTemplateInstantiationUnderTicks_;
+    long long ignoreFunctionUnderTicks_;
+
+    int analysisPass_;
+
+    // entries by how long their activity took, with a bucket for every 1/8th of a power of 2 ticks, so thresholds
+    // picked from them are never more than 12.5% off the exact one
+    struct DurationHistogram
+    {
+        static constexpr unsigned int SubBucketBits = 3;
+
+        // durations stay under 2^63 ticks
+        std::vector<unsigned long long> EntryCounts = std::vector<unsigned long long>((64 - SubBucketBits) << SubBucketBits);
+
+        void Add(long long durationTicks, unsigned long long entryCount);
+        static size_t GetBucket(long long durationTicks);
+        static long long GetBucketStart(size_t bucket);
+    };
+
+    // gathered during the measuring pass: entries for functions (by their duration) and whole template instantiation
+    // hierarchies (by their root's), and those that don't depend on any threshold
+    DurationHistogram functionDurations_;
+    DurationHistogram templateInstantiationDurations_;
+    unsigned long long fixedEntryCount_;
+    std::unordered_map<unsigned long long, unsigned long long> templateInstantiationCountPerThread_;
+    // the parent that last took a function or template instantiation on each thread, to estimate aggregates
+    std::unordered_map<unsigned long long, unsigned long long> candidateParentPerThread_;
+
+    // each long name is only written once, no matter how many entries share it: rather than the name itself,
+    // its length and a second hash are what tell whether a hash that's already taken is this name's
+    struct LongNameCheck
+    {
+        size_t Length = 0;
+        unsigned long long Hash = 0ULL;
+    };
+
+    std::unordered_map<unsigned long long, LongNameCheck> longNames_;
+    LongNameWriter* longNameWriter_;
+    std::string shortenedName_;
 
-    typedef std::vector<std::string> TFileInputs;
-    typedef std::vector<std::string> TFileOutputs;
+    typedef TPropertyList TFileInputs;
+    typedef TPropertyList TFileOutputs;
     typedef std::pair<TFileInputs, TFileOutputs> TFileInputsOutputs;
     std::unordered_map<unsigned long long, TFileInputsOutputs> fileInputsOutputsPerInvocation_;
 
     typedef unsigned long long TSymbolKey;
-    std::unordered_map<TSymbolKey, std::string> symbolNames_;
     typedef std::vector<unsigned long long> TUnresolvedTemplateInstantiationNames;
     std::unordered_map<TSymbolKey, TUnresolvedTemplateInstantiationNames> unresolvedTemplateInstantiationsPerSymbol_;
+
+    // a FrontEndPass resolves all of its symbols before it finishes, so whatever's still subscribed by then
+    // (i.e. symbols it never named) gets dropped along with it: a thread only runs a FrontEndPass at a time
+    typedef std::vector<TSymbolKey> TSubscribedSymbols;
+    std::unordered_map<unsigned long long, TSubscribedSymbols> subscribedSymbolsPerThread_;
+
+    // with deferred creation, template instantiations wait here until their root instantiation finishes and
+    // passes the filter: a thread has at most a root instantiation going on at a time, and records are kept
+    // in start order, so parents always come before their children
+    struct PendingTemplateInstantiation
+    {
+        unsigned long long Id = 0ULL;
+        unsigned long long ParentId = 0ULL;
+        unsigned long ProcessId = 0UL;
+        unsigned long ThreadId = 0UL;
+        long long StartTimestamp = 0LL;
+        long long StopTimestamp = 0LL;
+        TSymbolKey SymbolKey = 0ULL;
+    };
+
+    typedef std::vector<PendingTemplateInstantiation> TPendingTemplateInstantiations;
+    std::unordered_map<unsigned long long, TPendingTemplateInstantiations> pendingTemplateInstantiationsPerThread_;
+
+    // only the parent's last child can still take more siblings, so there's at most one aggregate per parent to
+    // keep track of, until a regular sibling comes in after it or the parent finishes (or gets released, for parents
+    // that are aggregates themselves)
+    struct Aggregate
+    {
+        TEntryIndex Index = InvalidEntryIndex;
+        AggregateKind Kind = AggregateKind::FUNCTION;
+        unsigned int Count = 0U;
+        long long DurationTicks = 0LL;
+    };
+
+    std::unordered_map<TEntryIndex, Aggregate> openAggregatesPerParent_;
+    // aggregates aren't activities, so they get ids counting down from the top, away from those of activities
+    unsigned long long nextAggregateId_;
+
+    // depth of the files that got an entry, only tracked when there's a cap
+    std::unordered_map<unsigned long long, unsigned int> includeDepths_;
+
+    // files past the cap, along with the aggregate they went into: only those right past the cap joined it, and
+    // know its parent, anything nested in them just goes along
+    struct CollapsedFile
+    {
+        unsigned long long AggregateId = 0ULL;
+        TEntryIndex AggregateParentIndex = InvalidEntryIndex;
+    };
+
+    std::unordered_map<unsigned long long, CollapsedFile> collapsedFiles_;
 };
 
 } // namespace vcperf
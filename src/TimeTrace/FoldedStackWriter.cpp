@@ -0,0 +1,145 @@
+#include "FoldedStackWriter.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <ostream>
+
+using namespace vcperf;
+
+namespace
+{
+    // the buffer gets handed to the stream once it grows past this size
+    constexpr size_t FlushThreshold = 1 << 20;
+
+}  // anonymous namespace
+
+FoldedStackWriter::FoldedStackWriter(std::ostream& outputStream, const SymbolNameStore& symbolNames, const TickConverter& tickConverter) :
+    outputStream_{outputStream},
+    symbolNames_{symbolNames},
+    tickConverter_{tickConverter},
+    buffer_{},
+    name_{},
+    cleanName_{},
+    names_{},
+    nodes_{ Node{} },
+    children_{},
+    frames_{},
+    stack_{}
+{
+}
+
+void FoldedStackWriter::BeginTrace()
+{
+}
+
+void FoldedStackWriter::EndTrace()
+{
+    assert(frames_.empty());
+
+    // in the order stacks first showed up, which is the same for the same trace
+    for (unsigned int node = 1; node < nodes_.size(); ++node)
+    {
+        long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(tickConverter_.ToNanoseconds(nodes_[node].ExclusiveTicks)).count();
+        if (microseconds <= 0) {
+            continue;
+        }
+
+        AppendStack(node);
+        buffer_.push_back(' ');
+        buffer_.append(std::to_string(microseconds));
+        buffer_.push_back('\n');
+
+        if (buffer_.size() >= FlushThreshold) {
+            Flush();
+        }
+    }
+
+    Flush();
+}
+
+void FoldedStackWriter::WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    unsigned int node = GetChildNode(entry);
+
+    Frame& frame = frames_.emplace_back();
+    frame.Node = node;
+    frame.StartTimestamp = entry->StartTimestamp;
+    frame.StopTimestamp = entry->StopTimestamp;
+    frame.CoveredUntil = entry->StartTimestamp;
+}
+
+void FoldedStackWriter::WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    assert(!frames_.empty());
+
+    Frame frame = frames_.back();
+    frames_.pop_back();
+
+    AddTime(frame.Node, frame.StartTimestamp, frame.StopTimestamp, frame.CoveredTicks);
+}
+
+void FoldedStackWriter::WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    AddTime(GetChildNode(entry), entry->StartTimestamp, entry->StopTimestamp, 0LL);
+}
+
+unsigned int FoldedStackWriter::GetChildNode(const ExecutionHierarchy::Entry* entry)
+{
+    // ';' separates frames and line breaks separate stacks
+    const std::string& name = entry->GetName(symbolNames_, name_);
+    cleanName_.assign(name);
+    std::replace(cleanName_.begin(), cleanName_.end(), ';', ':');
+    std::replace(cleanName_.begin(), cleanName_.end(), '\n', ' ');
+    std::replace(cleanName_.begin(), cleanName_.end(), '\r', ' ');
+
+    unsigned int parent = frames_.empty() ? 0U : frames_.back().Node;
+    StringInterner::TStringId nameId = names_.Intern(cleanName_);
+
+    auto result = children_.try_emplace((static_cast<unsigned long long>(parent) << 32) | nameId, static_cast<unsigned int>(nodes_.size()));
+    if (result.second) {
+        nodes_.push_back(Node{ parent, nameId, 0LL });
+    }
+
+    return result.first->second;
+}
+
+void FoldedStackWriter::AddTime(unsigned int node, long long startTimestamp, long long stopTimestamp, long long coveredTicks)
+{
+    nodes_[node].ExclusiveTicks += std::max(stopTimestamp - startTimestamp - coveredTicks, 0LL);
+
+    // let the parent know which part of its time this covered
+    if (!frames_.empty())
+    {
+        Frame& parent = frames_.back();
+
+        long long coveredStart = std::max(startTimestamp, parent.CoveredUntil);
+        if (stopTimestamp > coveredStart)
+        {
+            parent.CoveredTicks += stopTimestamp - coveredStart;
+            parent.CoveredUntil = stopTimestamp;
+        }
+    }
+}
+
+void FoldedStackWriter::AppendStack(unsigned int node)
+{
+    stack_.clear();
+    for (; node != 0U; node = nodes_[node].Parent) {
+        stack_.push_back(node);
+    }
+
+    for (auto it = stack_.rbegin(); it != stack_.rend(); ++it)
+    {
+        if (it != stack_.rbegin()) {
+            buffer_.push_back(';');
+        }
+
+        buffer_.append(names_.GetString(nodes_[*it].Name));
+    }
+}
+
+void FoldedStackWriter::Flush()
+{
+    outputStream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+}
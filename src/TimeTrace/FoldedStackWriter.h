@@ -0,0 +1,80 @@
+#pragma once
+
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TimeTrace\ExecutionHierarchy.h"
+#include "TimeTrace\StringInterner.h"
+#include "TimeTrace\SymbolNameStore.h"
+#include "TimeTrace\TickConverter.h"
+#include "TimeTrace\TraceWriter.h"
+
+namespace vcperf
+{
+
+// writes folded stacks for flame graphs (i.e. "CL Invocation 12;FrontEndPass;C:\src\foo.cpp;<vector> 1234"): each entry
+// adds its exclusive time (what none of its children cover) to the stack of names leading to it, and stacks that show
+// up several times in the build get merged, so only distinct ones are kept, and written once the trace ends
+class FoldedStackWriter : public TraceWriter
+{
+public:
+
+    FoldedStackWriter(std::ostream& outputStream, const SymbolNameStore& symbolNames, const TickConverter& tickConverter);
+
+    void BeginTrace() override;
+    void EndTrace() override;
+
+    // lanes don't matter to stacks
+    void WriteProcessName(unsigned long processId, std::string_view name) override {}
+    void WriteThreadName(unsigned long processId, unsigned long threadId, std::string_view name) override {}
+
+    void WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+    void WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+    void WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+
+private:
+
+    // stacks live in a tree of frames, merged by parent and name (node 0 is the empty stack)
+    struct Node
+    {
+        unsigned int Parent = 0U;
+        StringInterner::TStringId Name = 0U;
+        long long ExclusiveTicks = 0LL;
+    };
+
+    // an entry whose children are being written
+    struct Frame
+    {
+        unsigned int Node = 0U;
+        long long StartTimestamp = 0LL;
+        long long StopTimestamp = 0LL;
+        // children are sorted by start time, but may overlap (i.e. threads), so only the time they cover counts
+        long long CoveredTicks = 0LL;
+        long long CoveredUntil = 0LL;
+    };
+
+    unsigned int GetChildNode(const ExecutionHierarchy::Entry* entry);
+    void AddTime(unsigned int node, long long startTimestamp, long long stopTimestamp, long long coveredTicks);
+    void AppendStack(unsigned int node);
+
+    void Flush();
+
+    std::ostream& outputStream_;
+    const SymbolNameStore& symbolNames_;
+    const TickConverter& tickConverter_;
+    std::string buffer_;
+    // scratch buffers for names
+    std::string name_;
+    std::string cleanName_;
+
+    // names can't have the separator in them, so they're kept as they get written
+    StringInterner names_;
+    std::vector<Node> nodes_;
+    std::unordered_map<unsigned long long, unsigned int> children_;
+    std::vector<Frame> frames_;
+    std::vector<unsigned int> stack_;
+};
+
+} // namespace vcperf
@@ -0,0 +1,421 @@
+#include "JsonTraceWriter.h"
+
+#include <assert.h>
+#include <charconv>
+#include <ostream>
+
+using namespace vcperf;
+
+namespace
+{
+    // the buffer gets handed to the stream once it grows past this size
+    constexpr size_t FlushThreshold = 1 << 20;
+
+    // shorter values take about as many bytes to reference as to write
+    constexpr size_t MinSharedArgSize = 32;
+
+    long long ToMicroseconds(std::chrono::nanoseconds timestamp)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(timestamp).count();
+    }
+
+}  // anonymous namespace
+
+JsonTraceWriter::JsonTraceWriter(std::ostream& outputStream, const StringInterner& strings, const SymbolNameStore& symbolNames,
+                                 const TickConverter& tickConverter, bool isCompact, bool shareArgs) :
+    outputStream_{outputStream},
+    strings_{strings},
+    symbolNames_{symbolNames},
+    tickConverter_{tickConverter},
+    buffer_{},
+    name_{},
+    isCompact_{isCompact},
+    shareArgs_{shareArgs},
+    isFirstEvent_{true},
+    isFragment_{false},
+    writtenSharedArgs_{},
+    fragmentSharedArgs_{}
+{
+    buffer_.reserve(FlushThreshold + FlushThreshold / 4);
+}
+
+void JsonTraceWriter::BeginTrace()
+{
+    Append(isCompact_ ? "{\"traceEvents\":[" : "{\n\"traceEvents\": [");
+}
+
+void JsonTraceWriter::EndTrace()
+{
+    // although "ms" is the default time unit, make it explicit ("ms" means "microseconds")
+    Append(isCompact_ ? "]}\n" : "\n],\n\"displayTimeUnit\": \"ms\"\n}\n");
+    Flush();
+}
+
+void JsonTraceWriter::WriteProcessName(unsigned long processId, std::string_view name)
+{
+    WriteMetadataEvent("process_name", processId, 0UL, name);
+}
+
+void JsonTraceWriter::WriteThreadName(unsigned long processId, unsigned long threadId, std::string_view name)
+{
+    WriteMetadataEvent("thread_name", processId, threadId, name);
+}
+
+void JsonTraceWriter::WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    // the entry's stop is already known, so a complete event can wrap its children just as well
+    if (isCompact_)
+    {
+        WriteCompleteEvent(entry, processId, threadId);
+        return;
+    }
+
+    WriteSharedArgs(entry);
+    BeginEvent('B', processId, threadId);
+
+    AppendKey("name");
+    AppendString(entry->GetName(symbolNames_, name_));
+    AppendKey("ts");
+    AppendNumber(ConvertTimestamp(entry->StartTimestamp));
+    AppendProperties(entry);
+
+    EndEvent();
+}
+
+void JsonTraceWriter::WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    if (isCompact_) {
+        return;
+    }
+
+    BeginEvent('E', processId, threadId);
+
+    AppendKey("ts");
+    AppendNumber(ConvertTimestamp(entry->StopTimestamp));
+
+    EndEvent();
+}
+
+void JsonTraceWriter::WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    WriteSharedArgs(entry);
+    BeginEvent('X', processId, threadId);
+
+    AppendKey("name");
+    AppendString(entry->GetName(symbolNames_, name_));
+    AppendKey("ts");
+
+    if (isCompact_)
+    {
+        // both ends get rounded the same way, so children never end after their parent
+        long long start = ConvertTimestamp(entry->StartTimestamp);
+        AppendNumber(start);
+        AppendKey("dur");
+        AppendNumber(ConvertTimestamp(entry->StopTimestamp) - start);
+    }
+    else
+    {
+        std::chrono::nanoseconds start = tickConverter_.ToNanoseconds(entry->StartTimestamp);
+        AppendNumber(ToMicroseconds(start));
+        AppendKey("dur");
+        AppendNumber(ToMicroseconds(tickConverter_.ToNanoseconds(entry->StopTimestamp) - start));
+    }
+
+    AppendProperties(entry);
+
+    EndEvent();
+}
+
+std::unique_ptr<TraceWriter> JsonTraceWriter::CreateFragmentWriter() const
+{
+    auto fragment = std::make_unique<JsonTraceWriter>(outputStream_, strings_, symbolNames_, tickConverter_, isCompact_, shareArgs_);
+
+    // written as if some event came before, AppendFragment takes care of it when that's not the case
+    fragment->isFirstEvent_ = false;
+    fragment->isFragment_ = true;
+
+    return fragment;
+}
+
+void JsonTraceWriter::AppendFragment(TraceWriter& fragmentWriter)
+{
+    JsonTraceWriter& fragment = static_cast<JsonTraceWriter&>(fragmentWriter);
+    assert(fragment.isFragment_);
+
+    // shared args go right before the first event that uses them, like they would have without fragments,
+    // unless an earlier fragment already got them out
+    size_t eventsStart = 0;
+    for (const auto& sharedArg : fragment.fragmentSharedArgs_)
+    {
+        AppendFragmentEvents(std::string_view{ fragment.buffer_ }.substr(eventsStart, sharedArg.first - eventsStart));
+        eventsStart = sharedArg.first;
+
+        WriteSharedArg(sharedArg.second);
+    }
+    fragment.fragmentSharedArgs_.clear();
+
+    AppendFragmentEvents(std::string_view{ fragment.buffer_ }.substr(eventsStart));
+
+    // keeps its capacity for the fragment writer's next run of events
+    fragment.buffer_.clear();
+}
+
+void JsonTraceWriter::AppendFragmentEvents(std::string_view events)
+{
+    if (events.empty()) {
+        return;
+    }
+
+    if (isFirstEvent_)
+    {
+        // drops the separator
+        events.remove_prefix(1);
+        isFirstEvent_ = false;
+    }
+
+    Flush();
+    outputStream_.write(events.data(), static_cast<std::streamsize>(events.size()));
+}
+
+void JsonTraceWriter::BeginEvent(char phase, unsigned long processId, unsigned long threadId)
+{
+    if (isCompact_) {
+        Append(isFirstEvent_ ? "{\"ph\":\"" : ",{\"ph\":\"");
+    }
+    else {
+        Append(isFirstEvent_ ? "\n{\"ph\":\"" : ",\n{\"ph\":\"");
+    }
+    buffer_.push_back(phase);
+    buffer_.push_back('"');
+    isFirstEvent_ = false;
+
+    AppendKey("pid");
+    AppendNumber(processId);
+    AppendKey("tid");
+    AppendNumber(threadId);
+}
+
+void JsonTraceWriter::EndEvent()
+{
+    buffer_.push_back('}');
+
+    // fragments keep everything until they get appended
+    if (!isFragment_ && buffer_.size() >= FlushThreshold) {
+        Flush();
+    }
+}
+
+void JsonTraceWriter::WriteMetadataEvent(std::string_view metadataName, unsigned long processId, unsigned long threadId, std::string_view name)
+{
+    BeginEvent('M', processId, threadId);
+
+    AppendKey("name");
+    AppendString(metadataName);
+    AppendKey("args");
+    Append("{\"name\":");
+    AppendString(name);
+    buffer_.push_back('}');
+
+    EndEvent();
+}
+
+long long JsonTraceWriter::ConvertTimestamp(long long timestamp) const
+{
+    if (isCompact_) {
+        timestamp -= tickConverter_.GetOrigin();
+    }
+
+    return ToMicroseconds(tickConverter_.ToNanoseconds(timestamp));
+}
+
+void JsonTraceWriter::WriteSharedArgs(const ExecutionHierarchy::Entry* entry)
+{
+    if (!shareArgs_) {
+        return;
+    }
+
+    for (const ExecutionHierarchy::Property& property : entry->Properties)
+    {
+        if (!property.IsList) {
+            WriteSharedArg(property.Value);
+            continue;
+        }
+
+        for (StringInterner::TStringId value : entry->PropertyLists[property.Value]) {
+            WriteSharedArg(value);
+        }
+    }
+}
+
+void JsonTraceWriter::WriteSharedArg(StringInterner::TStringId value)
+{
+    if (!IsSharedArg(value)) {
+        return;
+    }
+
+    if (value >= writtenSharedArgs_.size()) {
+        writtenSharedArgs_.resize(strings_.GetCount(), false);
+    }
+
+    if (writtenSharedArgs_[value]) {
+        return;
+    }
+    writtenSharedArgs_[value] = true;
+
+    // a fragment only mentions each value once, even if several of its runs of events use it: whatever the first
+    // of them needed is already out by the time the others get appended
+    if (isFragment_)
+    {
+        fragmentSharedArgs_.emplace_back(buffer_.size(), value);
+        return;
+    }
+
+    BeginEvent('M', 0UL, 0UL);
+
+    // ids only need to be unique, so reuse the interner's
+    AppendKey("name");
+    AppendString("shared_arg");
+    AppendKey("args");
+    Append("{\"id\":");
+    AppendNumber(value);
+    Append(",\"value\":");
+    AppendString(strings_.GetString(value));
+    buffer_.push_back('}');
+
+    EndEvent();
+}
+
+bool JsonTraceWriter::IsSharedArg(StringInterner::TStringId value) const
+{
+    return shareArgs_ && strings_.GetString(value).size() >= MinSharedArgSize;
+}
+
+void JsonTraceWriter::AppendProperties(const ExecutionHierarchy::Entry* entry)
+{
+    if (entry->Properties.empty()) {
+        return;
+    }
+
+    // properties are already sorted by key
+    AppendKey("args");
+    buffer_.push_back('{');
+
+    bool isFirstProperty = true;
+    for (const ExecutionHierarchy::Property& property : entry->Properties)
+    {
+        if (!isFirstProperty) {
+            buffer_.push_back(',');
+        }
+        isFirstProperty = false;
+
+        AppendString(strings_.GetString(property.Key));
+        buffer_.push_back(':');
+
+        if (!property.IsList)
+        {
+            AppendValue(property.Value);
+            continue;
+        }
+
+        buffer_.push_back('[');
+
+        bool isFirstValue = true;
+        for (StringInterner::TStringId value : entry->PropertyLists[property.Value])
+        {
+            if (!isFirstValue) {
+                buffer_.push_back(',');
+            }
+            isFirstValue = false;
+
+            AppendValue(value);
+        }
+
+        buffer_.push_back(']');
+    }
+
+    buffer_.push_back('}');
+}
+
+void JsonTraceWriter::AppendValue(StringInterner::TStringId value)
+{
+    // values are always strings, so a number can only be a shared value's id
+    if (IsSharedArg(value)) {
+        AppendNumber(value);
+    }
+    else {
+        AppendString(strings_.GetString(value));
+    }
+}
+
+void JsonTraceWriter::AppendKey(std::string_view key)
+{
+    // keys are only ever written after "ph", so they always need a separator
+    buffer_.push_back(',');
+    buffer_.push_back('"');
+    Append(key);
+    Append("\":");
+}
+
+void JsonTraceWriter::AppendString(std::string_view value)
+{
+    AppendEscapedString(buffer_, value);
+}
+
+void JsonTraceWriter::AppendEscapedString(std::string& output, std::string_view value)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    output.push_back('"');
+
+    // copy runs of characters that don't need escaping in one go
+    size_t runStart = 0;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(value[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        output.append(value.data() + runStart, i - runStart);
+        runStart = i + 1;
+
+        switch (c)
+        {
+        case '"':  output.append("\\\""); break;
+        case '\\': output.append("\\\\"); break;
+        case '\b': output.append("\\b"); break;
+        case '\f': output.append("\\f"); break;
+        case '\n': output.append("\\n"); break;
+        case '\r': output.append("\\r"); break;
+        case '\t': output.append("\\t"); break;
+        default:
+            output.append("\\u00");
+            output.push_back(hexDigits[c >> 4]);
+            output.push_back(hexDigits[c & 0xF]);
+            break;
+        }
+    }
+    output.append(value.data() + runStart, value.size() - runStart);
+
+    output.push_back('"');
+}
+
+void JsonTraceWriter::AppendNumber(long long value)
+{
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    assert(result.ec == std::errc());
+
+    buffer_.append(digits, result.ptr - digits);
+}
+
+void JsonTraceWriter::Append(std::string_view text)
+{
+    buffer_.append(text.data(), text.size());
+}
+
+void JsonTraceWriter::Flush()
+{
+    outputStream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+}
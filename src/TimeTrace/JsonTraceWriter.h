@@ -0,0 +1,91 @@
+#pragma once
+
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "TimeTrace\ExecutionHierarchy.h"
+#include "TimeTrace\StringInterner.h"
+#include "TimeTrace\SymbolNameStore.h"
+#include "TimeTrace\TickConverter.h"
+#include "TimeTrace\TraceWriter.h"
+
+namespace vcperf
+{
+
+// writes Chrome's Trace Event Format (JSON) straight to a stream, one event at a time, so
+// memory usage doesn't depend on how many entries get exported
+class JsonTraceWriter : public TraceWriter
+{
+public:
+
+    // compact traces only use complete ("X") events, with timestamps relative to the start of the trace
+    // and no whitespace or fields viewers already default to
+    // with shareArgs, each long property value gets written once, in a "shared_arg" metadata event, and
+    // entries refer to it by the (numeric) id that event carries
+    JsonTraceWriter(std::ostream& outputStream, const StringInterner& strings, const SymbolNameStore& symbolNames,
+                    const TickConverter& tickConverter, bool isCompact, bool shareArgs);
+
+    // appends value as a JSON string, quotes included
+    static void AppendEscapedString(std::string& output, std::string_view value);
+
+    void BeginTrace() override;
+    void EndTrace() override;
+
+    void WriteProcessName(unsigned long processId, std::string_view name) override;
+    void WriteThreadName(unsigned long processId, unsigned long threadId, std::string_view name) override;
+
+    void WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+    void WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+    void WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+
+    std::unique_ptr<TraceWriter> CreateFragmentWriter() const override;
+    void AppendFragment(TraceWriter& fragment) override;
+
+private:
+
+    // writes events a fragment has in its buffer, from a point where it wrote nothing else (see fragmentSharedArgs_)
+    void AppendFragmentEvents(std::string_view events);
+
+    void BeginEvent(char phase, unsigned long processId, unsigned long threadId);
+    void EndEvent();
+
+    void WriteMetadataEvent(std::string_view metadataName, unsigned long processId, unsigned long threadId, std::string_view name);
+    void WriteSharedArgs(const ExecutionHierarchy::Entry* entry);
+    void WriteSharedArg(StringInterner::TStringId value);
+    bool IsSharedArg(StringInterner::TStringId value) const;
+
+    // in microseconds, relative to the start of the trace when compact
+    long long ConvertTimestamp(long long timestamp) const;
+
+    void AppendProperties(const ExecutionHierarchy::Entry* entry);
+    void AppendValue(StringInterner::TStringId value);
+    void AppendKey(std::string_view key);
+    void AppendString(std::string_view value);
+    void AppendNumber(long long value);
+    void Append(std::string_view text);
+
+    void Flush();
+
+    std::ostream& outputStream_;
+    const StringInterner& strings_;
+    const SymbolNameStore& symbolNames_;
+    const TickConverter& tickConverter_;
+    std::string buffer_;
+    // scratch buffer for names kept in the store
+    std::string name_;
+    bool isCompact_;
+    bool shareArgs_;
+    bool isFirstEvent_;
+    bool isFragment_;
+
+    // indexed by property value, set once its "shared_arg" event is out
+    std::vector<bool> writtenSharedArgs_;
+    // fragments can't know which ones are out already, so they leave it to AppendFragment, along with where
+    // in their buffer each one would have gone
+    std::vector<std::pair<size_t, StringInterner::TStringId>> fragmentSharedArgs_;
+};
+
+} // namespace vcperf
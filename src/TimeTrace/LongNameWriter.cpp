@@ -0,0 +1,59 @@
+#include "LongNameWriter.h"
+
+#include "TimeTrace\ExecutionHierarchy.h"
+#include "TimeTrace\JsonTraceWriter.h"
+
+using namespace vcperf;
+
+namespace
+{
+    // the buffer gets handed to the stream once it grows past this size
+    constexpr size_t FlushThreshold = 1 << 20;
+
+}  // anonymous namespace
+
+LongNameWriter::LongNameWriter(const std::filesystem::path& outputFile) :
+    outputFile_{outputFile},
+    outputStream_{},
+    buffer_{},
+    nameCount_{0}
+{
+}
+
+void LongNameWriter::Add(unsigned long long hash, std::string_view name)
+{
+    if (nameCount_ == 0)
+    {
+        outputStream_.open(outputFile_, std::ios::out | std::ios::binary | std::ios::trunc);
+        buffer_.append("{\n\"names\": {");
+    }
+
+    buffer_.append(nameCount_ == 0 ? "\n\"" : ",\n\"");
+    ExecutionHierarchy::AppendNameHash(buffer_, hash);
+    buffer_.append("\":");
+    JsonTraceWriter::AppendEscapedString(buffer_, name);
+    ++nameCount_;
+
+    if (buffer_.size() >= FlushThreshold) {
+        Flush();
+    }
+}
+
+bool LongNameWriter::Close()
+{
+    if (nameCount_ == 0) {
+        return true;
+    }
+
+    buffer_.append("\n}\n}\n");
+    Flush();
+
+    outputStream_.close();
+    return !outputStream_.fail();
+}
+
+void LongNameWriter::Flush()
+{
+    outputStream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+namespace vcperf
+{
+
+// writes the full names of entries that got a shortened one (see ExecutionHierarchy::Filter::MaxNameLength) to a side
+// file, keyed by the hash shortened names end with, as soon as the hierarchy shortens them: nothing keeps them around
+// until the end of the analysis, and the file only gets created once there's a name to write
+class LongNameWriter
+{
+public:
+
+    LongNameWriter(const std::filesystem::path& outputFile);
+
+    // each hash is expected only once, as the hierarchy moves names whose hash is taken to a free one
+    void Add(unsigned long long hash, std::string_view name);
+
+    // finishes the file, if there's one, and returns false if anything failed along the way
+    bool Close();
+
+private:
+
+    void Flush();
+
+    std::filesystem::path outputFile_;
+    std::ofstream outputStream_;
+    std::string buffer_;
+    size_t nameCount_;
+};
+
+} // namespace vcperf
@@ -2,28 +2,224 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
 
 using namespace vcperf;
 
-PackedProcessThreadRemapping::PackedProcessThreadRemapping() :
-    remappings_{},
-    localOffsetsData_{}
+namespace
+{
+    constexpr size_t NoParent = static_cast<size_t>(-1);
+
+    // COMPACT buckets placed roots by the highest bit set in their duration
+    size_t GetDurationBucket(long long duration)
+    {
+        size_t bucket = 0;
+        for (unsigned long long value = static_cast<unsigned long long>(duration); value > 1ULL; value >>= 1) {
+            ++bucket;
+        }
+
+        return bucket;
+    }
+
+}  // anonymous namespace
+
+PackedProcessThreadRemapping::LaneAssigner::LaneAssigner() :
+    activeIntervals_{},
+    freeLanes_{},
+    laneCount_{0UL},
+    busyLanes_{}
+{
+}
+
+unsigned long PackedProcessThreadRemapping::LaneAssigner::Assign(long long startTimestamp, long long stopTimestamp)
+{
+    auto stopsLater = [](const ActiveInterval& lhs, const ActiveInterval& rhs) { return lhs.StopTimestamp > rhs.StopTimestamp; };
+    auto isHigher = [](unsigned long lhs, unsigned long rhs) { return lhs > rhs; };
+
+    // intervals come by start time, so those that stopped by now can't overlap this one, nor any of the next ones
+    while (!activeIntervals_.empty() && activeIntervals_.front().StopTimestamp <= startTimestamp)
+    {
+        freeLanes_.push_back(activeIntervals_.front().Lane);
+        std::push_heap(freeLanes_.begin(), freeLanes_.end(), isHigher);
+
+        std::pop_heap(activeIntervals_.begin(), activeIntervals_.end(), stopsLater);
+        activeIntervals_.pop_back();
+    }
+
+    // a zero-length interval doesn't overlap those that started along with it (see ExecutionHierarchy::Entry::OverlapsWith),
+    // so it may share their lane: as it doesn't overlap anything coming after either, it's done without taking any lane
+    if (startTimestamp == stopTimestamp)
+    {
+        busyLanes_.clear();
+        for (const ActiveInterval& interval : activeIntervals_)
+        {
+            if (interval.StartTimestamp < startTimestamp) {
+                busyLanes_.push_back(interval.Lane);
+            }
+        }
+
+        std::sort(busyLanes_.begin(), busyLanes_.end());
+
+        unsigned long lane = 0UL;
+        for (unsigned long busyLane : busyLanes_)
+        {
+            if (busyLane > lane) {
+                break;
+            }
+
+            lane = busyLane + 1;
+        }
+
+        return lane;
+    }
+
+    // any other interval overlaps all active ones, so it gets the lowest lane none of them is using
+    unsigned long lane = laneCount_;
+    if (!freeLanes_.empty())
+    {
+        std::pop_heap(freeLanes_.begin(), freeLanes_.end(), isHigher);
+        lane = freeLanes_.back();
+        freeLanes_.pop_back();
+    }
+    else {
+        ++laneCount_;
+    }
+
+    activeIntervals_.push_back({ startTimestamp, stopTimestamp, lane });
+    std::push_heap(activeIntervals_.begin(), activeIntervals_.end(), stopsLater);
+
+    return lane;
+}
+
+void PackedProcessThreadRemapping::LaneAssigner::Clear()
+{
+    activeIntervals_.clear();
+    freeLanes_.clear();
+    laneCount_ = 0UL;
+}
+
+PackedProcessThreadRemapping::PackedProcessThreadRemapping(Strategy strategy) :
+    strategy_{strategy},
+    remaps_{},
+    localOffsetsData_{},
+    rootLanes_{},
+    childrenLanes_{},
+    openParents_{},
+    placedRootBuckets_{},
+    stableProcessIds_{},
+    nextMovedProcessId_{1UL},
+    processNames_{},
+    threadNames_{},
+    namedProcesses_{},
+    namedThreads_{}
 {
 }
 
 void PackedProcessThreadRemapping::Calculate(const ExecutionHierarchy* hierarchy)
 {
     assert(hierarchy != nullptr);
-    assert(remappings_.empty());
+    const ExecutionHierarchy::Layout& layout = hierarchy->GetLayout();
 
-    RemapRootsProcessId(hierarchy);
-    RemapEntriesThreadId(hierarchy);
+    remaps_.assign(layout.Size(), Remap{});
+
+    switch (strategy_)
+    {
+    case Strategy::PACKED:
+        RemapRootsProcessId(layout);
+        RemapEntriesThreadId(layout);
+        break;
+
+    case Strategy::COMPACT:
+        PlaceRootsCompactly(layout);
+        RemapEntriesThreadId(layout);
+        break;
+
+    case Strategy::STABLE:
+        for (size_t rootPosition : layout.Roots) {
+            RemapStable(hierarchy, layout, rootPosition);
+        }
+        break;
+    }
 }
 
-void PackedProcessThreadRemapping::CalculateChildrenLocalThreadData(const ExecutionHierarchy::Entry* entry)
+void PackedProcessThreadRemapping::CalculateForRoot(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Layout& layout)
 {
+    assert(hierarchy != nullptr);
+    assert(layout.Roots.size() == 1);
+    const size_t rootPosition = layout.Roots.front();
+
+    remaps_.assign(layout.Size(), Remap{});
+
+    switch (strategy_)
+    {
+    case Strategy::PACKED:
+    {
+        // roots always get assigned to the lowest ThreadId
+        Remap& remap = remaps_[rootPosition];
+        remap.ProcessId = rootLanes_.Assign(layout.StartTimestamps[rootPosition], layout.StopTimestamps[rootPosition]);
+        remap.ThreadId = 0UL;
+
+        NameProcess(remap.ProcessId, "Lane " + std::to_string(remap.ProcessId));
+        RemapThreadIds(layout, rootPosition, openParents_);
+        break;
+    }
+
+    case Strategy::COMPACT:
+    {
+        // upcoming roots aren't known yet, so they can't be sorted: it's only first-fit here, in start order, and
+        // roots that started longer ago than the longest in their bucket lasts have stopped before any upcoming one
+        const long long rootStartTimestamp = layout.StartTimestamps[rootPosition];
+        for (PlacedRootBucket& bucket : placedRootBuckets_) {
+            bucket.RootsByStart.erase(bucket.RootsByStart.begin(), bucket.RootsByStart.lower_bound(rootStartTimestamp - bucket.LongestDuration));
+        }
+
+        PlaceRootCompactly(layout, rootPosition);
+        RemapThreadIds(layout, rootPosition, openParents_);
+        break;
+    }
+
+    case Strategy::STABLE:
+        RemapStable(hierarchy, layout, rootPosition);
+        break;
+    }
+}
+
+void PackedProcessThreadRemapping::ClearNames()
+{
+    processNames_.clear();
+    threadNames_.clear();
+}
+
+void PackedProcessThreadRemapping::Forget(const ExecutionHierarchy::Layout& layout)
+{
+    for (unsigned long long id : layout.Ids) {
+        localOffsetsData_.erase(id);
+    }
+}
+
+void PackedProcessThreadRemapping::CalculateChildrenLocalThreadData(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Entry* entry)
+{
+    assert(hierarchy != nullptr);
     assert(entry != nullptr);
 
+    // stable layouts don't use any local offsets
+    if (strategy_ == Strategy::STABLE) {
+        return;
+    }
+
+    // children that became entries all at once, when their parent finished, haven't been processed yet
+    // (see ExecutionHierarchy::Filter::DeferEntryCreation)
+    for (ExecutionHierarchy::TEntryIndex childIndex : entry->Children)
+    {
+        const ExecutionHierarchy::Entry* child = hierarchy->GetEntryAt(childIndex);
+        if (localOffsetsData_.find(child->Id) == localOffsetsData_.end()) {
+            CalculateChildrenLocalThreadData(hierarchy, child);
+        }
+    }
+
     if (entry->Children.size() == 0)
     {
         // it's a leaf, so we're sure there's no data for it yet
@@ -35,65 +231,39 @@ void PackedProcessThreadRemapping::CalculateChildrenLocalThreadData(const Execut
     }
     else
     {
-        CalculateChildrenLocalThreadId(entry);
-        CalculateChildrenExtraThreadIdToFitHierarchy(entry);
+        CalculateChildrenLocalThreadId(hierarchy, entry);
+        CalculateChildrenExtraThreadIdToFitHierarchy(hierarchy, entry);
     }
 }
 
-void PackedProcessThreadRemapping::CalculateChildrenLocalThreadId(const ExecutionHierarchy::Entry* entry)
+void PackedProcessThreadRemapping::CalculateChildrenLocalThreadId(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Entry* entry)
 {
     assert(entry->Children.size() > 0);
 
-    const std::vector<ExecutionHierarchy::Entry*>& children = entry->Children;
-    std::vector<unsigned long> overlappingLocalThreadIds;
-
-    for (auto itChild = children.begin(); itChild != children.end(); ++itChild)
+    // children are sorted by start time, so each one only has to avoid the previous siblings it overlaps
+    childrenLanes_.Clear();
+    for (ExecutionHierarchy::TEntryIndex childIndex : entry->Children)
     {
-        const ExecutionHierarchy::Entry* child = *itChild;
+        const ExecutionHierarchy::Entry* child = hierarchy->GetEntryAt(childIndex);
         auto itLocalOffsetData = localOffsetsData_.find(child->Id);
 
         // not finding it means it's been ignored, so we don't need to perform any calculations for it
-        if (itLocalOffsetData != localOffsetsData_.end())
-        {
-            // children are sorted by start time, so we only have to check previous siblings for overlaps
-            overlappingLocalThreadIds.clear();
-            for(auto itPrecedingSibling = std::make_reverse_iterator(itChild); itPrecedingSibling != children.rend(); ++itPrecedingSibling)
-            {
-                const ExecutionHierarchy::Entry* precedingSibling = *itPrecedingSibling;
-
-                if (child->OverlapsWith(precedingSibling))
-                {
-                    // preceding sibling has been processed already, if its data is missing it means it's ignored
-                    auto it = localOffsetsData_.find(precedingSibling->Id);
-                    if (it != localOffsetsData_.end()) {
-                        overlappingLocalThreadIds.push_back(it->second.RawLocalThreadId);
-                    }
-                }
-            }
-
-            // calculate first local ThreadId where we don't overlap any sibling
-            unsigned long localThreadId = 0UL;
-            while (std::find(overlappingLocalThreadIds.begin(), overlappingLocalThreadIds.end(), localThreadId) != overlappingLocalThreadIds.end())
-            {
-                ++localThreadId;
-            }
-
-            // update local ThreadId
-            assert(itLocalOffsetData != localOffsetsData_.end());
-            itLocalOffsetData->second.RawLocalThreadId = localThreadId;
+        if (itLocalOffsetData != localOffsetsData_.end()) {
+            itLocalOffsetData->second.RawLocalThreadId = childrenLanes_.Assign(child->StartTimestamp, child->StopTimestamp);
         }
     }
 }
 
-void PackedProcessThreadRemapping::CalculateChildrenExtraThreadIdToFitHierarchy(const ExecutionHierarchy::Entry* entry)
+void PackedProcessThreadRemapping::CalculateChildrenExtraThreadIdToFitHierarchy(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Entry* entry)
 {
     assert(entry->Children.size() > 0);
 
     // group children with their partial LocalOffsetData
     typedef std::pair<const ExecutionHierarchy::Entry*, LocalOffsetData*> EntryWithOffsetData;
     std::vector<EntryWithOffsetData> sortedChildrenWithData;
-    for (const ExecutionHierarchy::Entry* child : entry->Children)
+    for (ExecutionHierarchy::TEntryIndex childIndex : entry->Children)
     {
+        const ExecutionHierarchy::Entry* child = hierarchy->GetEntryAt(childIndex);
         auto it = localOffsetsData_.find(child->Id);
 
         // if data is missing, it means child is ignored
@@ -155,80 +325,295 @@ void PackedProcessThreadRemapping::CalculateChildrenExtraThreadIdToFitHierarchy(
     data.RequiredThreadIdToFitHierarchy = requiredThreadIdToFitHierarchy;
 }
 
-const PackedProcessThreadRemapping::Remap* PackedProcessThreadRemapping::GetRemapFor(unsigned long long id) const
+void PackedProcessThreadRemapping::RemapRootsProcessId(const ExecutionHierarchy::Layout& layout)
 {
-    auto it = remappings_.find(id);
-    return it != remappings_.end() ? &it->second : nullptr;
+    // entries are sorted by start time, so each root only has to avoid the previous ones it overlaps
+    rootLanes_.Clear();
+    for (size_t rootPosition : layout.Roots)
+    {
+        // roots always get assigned to the lowest ThreadId
+        Remap& remap = remaps_[rootPosition];
+        remap.ProcessId = rootLanes_.Assign(layout.StartTimestamps[rootPosition], layout.StopTimestamps[rootPosition]);
+        remap.ThreadId = 0UL;
+
+        NameProcess(remap.ProcessId, "Lane " + std::to_string(remap.ProcessId));
+    }
+}
+
+void PackedProcessThreadRemapping::PlaceRootsCompactly(const ExecutionHierarchy::Layout& layout)
+{
+    // first-fit decreasing: the roots needing the most threads get placed first, smaller ones fill in the gaps
+    typedef std::pair<unsigned long, size_t> RootWithThreadCount;
+    std::vector<RootWithThreadCount> roots;
+    for (size_t rootPosition : layout.Roots) {
+        roots.emplace_back(GetRequiredThreadCount(layout.Ids[rootPosition]), rootPosition);
+    }
+
+    std::stable_sort(roots.begin(), roots.end(), [](const RootWithThreadCount& lhs, const RootWithThreadCount& rhs) {
+        return lhs.first > rhs.first;
+    });
+
+    for (const RootWithThreadCount& root : roots) {
+        PlaceRootCompactly(layout, root.second);
+    }
+}
+
+void PackedProcessThreadRemapping::PlaceRootCompactly(const ExecutionHierarchy::Layout& layout, size_t rootPosition)
+{
+    const long long startTimestamp = layout.StartTimestamps[rootPosition];
+    const long long stopTimestamp = layout.StopTimestamps[rootPosition];
+    const unsigned long threadCount = GetRequiredThreadCount(layout.Ids[rootPosition]);
+
+    // gather the threads taken by already placed roots we overlap with (in each bucket, those that started before us
+    // can't have started before the longest one did)
+    typedef std::pair<unsigned long, unsigned long> ThreadRange;
+    std::vector<ThreadRange> takenThreads;
+
+    for (const PlacedRootBucket& bucket : placedRootBuckets_)
+    {
+        auto itPlacedRoot = bucket.RootsByStart.lower_bound(startTimestamp - bucket.LongestDuration);
+        for (; itPlacedRoot != bucket.RootsByStart.end() && itPlacedRoot->first < stopTimestamp; ++itPlacedRoot)
+        {
+            // same as ExecutionHierarchy::Entry::OverlapsWith
+            const PlacedRoot& placedRoot = itPlacedRoot->second;
+            if (startTimestamp < placedRoot.StopTimestamp && placedRoot.StartTimestamp < stopTimestamp) {
+                takenThreads.emplace_back(placedRoot.FirstThreadId, placedRoot.FirstThreadId + placedRoot.ThreadCount);
+            }
+        }
+    }
+
+    // lowest gap where the whole hierarchy fits
+    std::sort(takenThreads.begin(), takenThreads.end());
+
+    unsigned long firstThreadId = 0UL;
+    for (const ThreadRange& range : takenThreads)
+    {
+        if (range.first >= firstThreadId + threadCount) {
+            break;
+        }
+
+        firstThreadId = std::max(firstThreadId, range.second);
+    }
+
+    const long long duration = stopTimestamp - startTimestamp;
+    const size_t bucketIndex = GetDurationBucket(duration);
+    if (bucketIndex >= placedRootBuckets_.size()) {
+        placedRootBuckets_.resize(bucketIndex + 1);
+    }
+
+    PlacedRootBucket& bucket = placedRootBuckets_[bucketIndex];
+    bucket.RootsByStart.emplace(startTimestamp, PlacedRoot{ startTimestamp, stopTimestamp, firstThreadId, threadCount });
+    bucket.LongestDuration = std::max(bucket.LongestDuration, duration);
+
+    // all roots share a single process
+    Remap& remap = remaps_[rootPosition];
+    remap.ProcessId = 0UL;
+    remap.ThreadId = firstThreadId;
+
+    NameProcess(remap.ProcessId, "Invocations");
+}
+
+unsigned long PackedProcessThreadRemapping::GetRequiredThreadCount(unsigned long long rootId) const
+{
+    // no data means it never finished, nor did its children
+    auto it = localOffsetsData_.find(rootId);
+    return it != localOffsetsData_.end() ? it->second.RequiredThreadIdToFitHierarchy + 1UL : 1UL;
 }
 
-void PackedProcessThreadRemapping::RemapRootsProcessId(const ExecutionHierarchy* hierarchy)
+void PackedProcessThreadRemapping::RemapStable(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Layout& layout,
+                                               size_t rootPosition)
 {
-    const ExecutionHierarchy::TRoots& roots = hierarchy->GetRoots();
-    std::vector<unsigned long> overlappingProcessIds;
-    for (auto itRoot = roots.begin(); itRoot != roots.end(); ++itRoot)
+    const size_t rootEnd = rootPosition + layout.SubtreeSizes[rootPosition];
+
+    // a root is a process of its own, and processes only get one name for the whole trace: a root whose id an earlier
+    // root already had, because they overlap or because Windows reused the id once the earlier one exited, has to move
+    // (real ids are multiples of 4, which leaves odd ones for roots that move)
+    unsigned long processId = layout.ProcessIds[rootPosition];
+    while (!stableProcessIds_.insert(processId).second)
+    {
+        processId = nextMovedProcessId_;
+        nextMovedProcessId_ += 2;
+    }
+
+    // names aren't part of the layout
+    NameProcess(processId, hierarchy->GetEntryAt(layout.EntryIndices[rootPosition])->Name);
+
+    // each entry's parent is the closest entry before it whose subtree it's in
+    std::vector<size_t> parents(rootEnd - rootPosition, NoParent);
+    std::unordered_set<unsigned long> realThreadIds;
+
+    // where the subtrees we're in end, along with their position
+    std::vector<std::pair<size_t, size_t>> openEntries;
+    for (size_t position = rootPosition; position < rootEnd; ++position)
+    {
+        while (!openEntries.empty() && openEntries.back().first <= position) {
+            openEntries.pop_back();
+        }
+
+        if (!openEntries.empty()) {
+            parents[position - rootPosition] = openEntries.back().second;
+        }
+
+        openEntries.emplace_back(position + layout.SubtreeSizes[position], position);
+        realThreadIds.insert(layout.ThreadIds[position]);
+    }
+
+    // visit entries by start time, parents before their children, so each one can check whether it nests
+    // within what's going on in its thread at that point
+    std::vector<size_t> positions(rootEnd - rootPosition);
+    for (size_t i = 0; i < positions.size(); ++i) {
+        positions[i] = rootPosition + i;
+    }
+
+    std::stable_sort(positions.begin(), positions.end(), [&layout](size_t lhs, size_t rhs) {
+        return layout.StartTimestamps[lhs] < layout.StartTimestamps[rhs];
+    });
+
+    // stop timestamps of the entries still going on in each thread, innermost last
+    std::unordered_map<unsigned long, std::vector<long long>> openEntriesPerThread;
+    auto fits = [&openEntriesPerThread, &layout](unsigned long threadId, size_t position)
     {
-        const ExecutionHierarchy::Entry* root = *itRoot;
+        std::vector<long long>& openEntries = openEntriesPerThread[threadId];
+        while (!openEntries.empty() && openEntries.back() <= layout.StartTimestamps[position]) {
+            openEntries.pop_back();
+        }
+
+        return openEntries.empty() || layout.StopTimestamps[position] <= openEntries.back();
+    };
+
+    // threads that didn't exist, for entries that don't fit in theirs (odd ids, as with processes)
+    std::vector<unsigned long> extraThreadIds;
+    unsigned long nextExtraThreadId = 1UL;
+
+    for (size_t position : positions)
+    {
+        // entries in their parent's thread follow it, wherever it went
+        size_t parent = parents[position - rootPosition];
+        unsigned long threadId = layout.ThreadIds[position];
+        if (parent != NoParent && layout.ThreadIds[parent] == threadId) {
+            threadId = remaps_[parent].ThreadId;
+        }
 
-        // entries are sorted by start time, so we only have to check previous siblings for overlaps
-        overlappingProcessIds.clear();
-        for (auto itPrecedingSibling = std::make_reverse_iterator(itRoot); itPrecedingSibling != roots.rend(); ++itPrecedingSibling)
+        if (!fits(threadId, position))
         {
-            const ExecutionHierarchy::Entry* precedingSibling = *itPrecedingSibling;
+            auto itExtraThreadId = std::find_if(extraThreadIds.begin(), extraThreadIds.end(), [&fits, position](unsigned long extraThreadId) {
+                return fits(extraThreadId, position);
+            });
 
-            if (root->OverlapsWith(precedingSibling))
+            if (itExtraThreadId != extraThreadIds.end()) {
+                threadId = *itExtraThreadId;
+            }
+            else
             {
-                // preceding sibling has been processed already, so we must find a remap for it
-                auto it = remappings_.find(precedingSibling->Id);
-                assert(it != remappings_.end());
+                while (realThreadIds.find(nextExtraThreadId) != realThreadIds.end()) {
+                    nextExtraThreadId += 2;
+                }
 
-                overlappingProcessIds.push_back(it->second.ProcessId);
+                threadId = nextExtraThreadId;
+                nextExtraThreadId += 2;
+
+                extraThreadIds.push_back(threadId);
+                NameThread(processId, threadId, "Overlapping Activities");
             }
         }
 
-        // calculate first ProcessId where we don't overlap with any sibling
-        unsigned long remappedProcessId = 0UL;
-        while (std::find(overlappingProcessIds.begin(), overlappingProcessIds.end(), remappedProcessId) != overlappingProcessIds.end())
-        {
-            ++remappedProcessId;
-        }
+        openEntriesPerThread[threadId].push_back(layout.StopTimestamps[position]);
 
-        // roots always get assigned to the lowest ThreadId
-        assert(remappings_.find(root->Id) == remappings_.end());
-        Remap& remap = remappings_[root->Id];
-        remap.ProcessId = remappedProcessId;
-        remap.ThreadId = 0UL;
+        Remap& remap = remaps_[position];
+        remap.ProcessId = processId;
+        remap.ThreadId = threadId;
     }
 }
 
-void PackedProcessThreadRemapping::RemapEntriesThreadId(const ExecutionHierarchy* hierarchy)
+void PackedProcessThreadRemapping::RemapEntriesThreadId(const ExecutionHierarchy::Layout& layout)
 {
-    for (const ExecutionHierarchy::Entry* root : hierarchy->GetRoots())
+    // once roots have their ProcessId, their subtrees don't depend on each other, and each one fills its own
+    // range of remaps_: let every core take roots until there's none left, without starting more workers
+    // than there are roots (the calling thread being one of them)
+    const unsigned int workerCount = static_cast<unsigned int>(std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U),
+                                                                                layout.Roots.size()));
+    if (workerCount <= 1)
+    {
+        for (size_t rootPosition : layout.Roots) {
+            RemapThreadIds(layout, rootPosition, openParents_);
+        }
+        return;
+    }
+
+    std::atomic<size_t> nextRoot{ 0 };
+
+    auto work = [this, &layout, &nextRoot](TOpenParents& openParents)
     {
-        // this data must exist because we've already calculated ProcessId remappings
-        // remember: parallel entries at root level is represented via different ProcessId
-        auto it = remappings_.find(root->Id);
-        assert(it != remappings_.end());
+        for (size_t root = nextRoot++; root < layout.Roots.size(); root = nextRoot++) {
+            RemapThreadIds(layout, layout.Roots[root], openParents);
+        }
+    };
+
+    std::vector<TOpenParents> openParents(workerCount);
+    std::vector<std::thread> workers;
+    for (unsigned int worker = 1; worker < workerCount; ++worker) {
+        workers.emplace_back(work, std::ref(openParents[worker]));
+    }
+
+    work(openParents[0]);
 
-        RemapThreadIdFor(root, it->second.ProcessId, it->second.ThreadId);
+    for (std::thread& worker : workers) {
+        worker.join();
     }
 }
 
-void PackedProcessThreadRemapping::RemapThreadIdFor(const ExecutionHierarchy::Entry* entry, unsigned long remappedProcessId,
-                                                    unsigned long parentAbsoluteThreadId)
+void PackedProcessThreadRemapping::RemapThreadIds(const ExecutionHierarchy::Layout& layout, size_t rootPosition, TOpenParents& openParents)
 {
-    for (const ExecutionHierarchy::Entry* child : entry->Children)
+    // the root already has its remap, and every other entry's ThreadId is relative to its parent's: as parents
+    // come right before their subtree, a stack of the ones we're in (with the ThreadId they got) is enough
+    const size_t rootEnd = rootPosition + layout.SubtreeSizes[rootPosition];
+    const unsigned long processId = remaps_[rootPosition].ProcessId;
+
+    openParents.clear();
+    openParents.emplace_back(rootEnd, remaps_[rootPosition].ThreadId);
+
+    size_t position = rootPosition + 1;
+    while (position < rootEnd)
     {
-        auto itLocalData = localOffsetsData_.find(child->Id);
+        while (openParents.back().first <= position) {
+            openParents.pop_back();
+        }
 
-        // if data is missing, we can ignore the hierarchy altogether
-        if (itLocalData != localOffsetsData_.end())
+        const size_t end = position + layout.SubtreeSizes[position];
+        auto itLocalData = localOffsetsData_.find(layout.Ids[position]);
+
+        // if data is missing, the entry never finished: it keeps its own ids, and so does its whole subtree
+        if (itLocalData == localOffsetsData_.end())
         {
-            assert(remappings_.find(child->Id) == remappings_.end());
-            Remap& remap = remappings_[child->Id];
-            remap.ProcessId = remappedProcessId;
-            remap.ThreadId = parentAbsoluteThreadId + itLocalData->second.CalculatedLocalThreadId;
+            for (; position < end; ++position) {
+                remaps_[position] = { layout.ProcessIds[position], layout.ThreadIds[position] };
+            }
+            continue;
+        }
+
+        Remap& remap = remaps_[position];
+        remap.ProcessId = processId;
+        remap.ThreadId = openParents.back().second + itLocalData->second.CalculatedLocalThreadId;
 
-            RemapThreadIdFor(child, remappedProcessId, remap.ThreadId);
+        if (end > position + 1) {
+            openParents.emplace_back(end, remap.ThreadId);
         }
+
+        ++position;
+    }
+}
+
+void PackedProcessThreadRemapping::NameProcess(unsigned long processId, const std::string& name)
+{
+    // the first name is the one that sticks
+    if (namedProcesses_.insert(processId).second) {
+        processNames_.push_back({ processId, name });
+    }
+}
+
+void PackedProcessThreadRemapping::NameThread(unsigned long processId, unsigned long threadId, const std::string& name)
+{
+    if (namedThreads_.insert((static_cast<unsigned long long>(processId) << 32) | threadId).second) {
+        threadNames_.push_back({ processId, threadId, name });
     }
 }
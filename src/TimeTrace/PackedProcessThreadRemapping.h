@@ -1,6 +1,11 @@
 #pragma once
 
+#include <map>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "TimeTrace\ExecutionHierarchy.h"
 
@@ -11,20 +16,63 @@ class PackedProcessThreadRemapping
 {
 public:
 
+    // how entries get laid out in processes and threads
+    enum class Strategy
+    {
+        // each root in the lowest process it doesn't overlap another root in, each child in the lowest thread
+        // it doesn't overlap a sibling in
+        PACKED,
+
+        // same layout within roots, but all roots share a single process: the ones needing the most threads
+        // get placed first, and the rest fill in the gaps, which minimizes how many threads get used
+        COMPACT,
+
+        // keeps the real ProcessId and ThreadId, and only moves entries that would overlap (without nesting)
+        // some other entry in their thread, and roots whose ProcessId an earlier root already had
+        STABLE
+    };
+
     struct Remap
     {
         unsigned long ProcessId = 0UL;
         unsigned long ThreadId = 0UL;
     };
 
+    // names for the processes and threads entries got remapped to, in the order they were first used
+    struct ProcessName
+    {
+        unsigned long ProcessId = 0UL;
+        std::string Name;
+    };
+
+    struct ThreadName
+    {
+        unsigned long ProcessId = 0UL;
+        unsigned long ThreadId = 0UL;
+        std::string Name;
+    };
+
 public:
 
-    PackedProcessThreadRemapping();
+    PackedProcessThreadRemapping(Strategy strategy);
 
+    // remaps the whole layout of a finalized hierarchy (see ExecutionHierarchy::Finalize)
     void Calculate(const ExecutionHierarchy* hierarchy);
-    void CalculateChildrenLocalThreadData(const ExecutionHierarchy::Entry* entry);
+    void CalculateChildrenLocalThreadData(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Entry* entry);
+
+    // incremental alternative to Calculate, for a layout holding a single root (see ExecutionHierarchy::Flatten),
+    // one root at a time in the same order ExecutionHierarchy keeps them, so roots can get written and forgotten
+    // as they finish: same results, but only needs to remember the roots that may still overlap upcoming ones
+    void CalculateForRoot(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Layout& layout);
+    void Forget(const ExecutionHierarchy::Layout& layout);
 
-    const Remap* GetRemapFor(unsigned long long id) const;
+    // for the entry at this position in the layout last remapped
+    inline const Remap& GetRemapAt(size_t position) const { return remaps_[position]; }
+    inline const std::vector<ProcessName>& GetProcessNames() const { return processNames_; }
+    inline const std::vector<ThreadName>& GetThreadNames() const { return threadNames_; }
+
+    // once they've been written, when streaming
+    void ClearNames();
 
 private:
 
@@ -35,16 +83,93 @@ private:
         unsigned long CalculatedLocalThreadId = 0UL;
     };
 
-    void RemapRootsProcessId(const ExecutionHierarchy* hierarchy);
-    void RemapEntriesThreadId(const ExecutionHierarchy* hierarchy);
-    void RemapThreadIdFor(const ExecutionHierarchy::Entry* entry, unsigned long remappedProcessId,
-                          unsigned long parentAbsoluteThreadId);
+    // gives each interval, visited by start time, the lowest lane where it doesn't overlap any earlier interval:
+    // a sweep that only keeps track of the ones still going on (by stop time) and of the lanes they left free
+    class LaneAssigner
+    {
+    public:
+
+        LaneAssigner();
+
+        unsigned long Assign(long long startTimestamp, long long stopTimestamp);
+        void Clear();
+
+    private:
 
-    void CalculateChildrenLocalThreadId(const ExecutionHierarchy::Entry* entry);
-    void CalculateChildrenExtraThreadIdToFitHierarchy(const ExecutionHierarchy::Entry* entry);
+        struct ActiveInterval
+        {
+            long long StartTimestamp = 0LL;
+            long long StopTimestamp = 0LL;
+            unsigned long Lane = 0UL;
+        };
 
-    std::unordered_map<unsigned long long, Remap> remappings_;
+        // both are heaps: earliest stop and lowest lane first
+        std::vector<ActiveInterval> activeIntervals_;
+        std::vector<unsigned long> freeLanes_;
+        unsigned long laneCount_;
+
+        // scratch buffer for zero-length intervals
+        std::vector<unsigned long> busyLanes_;
+    };
+
+    // a root placed by the COMPACT strategy, using threads [FirstThreadId, FirstThreadId + ThreadCount)
+    struct PlacedRoot
+    {
+        long long StartTimestamp = 0LL;
+        long long StopTimestamp = 0LL;
+        unsigned long FirstThreadId = 0UL;
+        unsigned long ThreadCount = 0UL;
+    };
+
+    // placed roots whose duration has the same highest bit, by start time: none of them lasts twice as long as another,
+    // so looking back as far as the longest one only visits roots that overlap, or stopped shortly before
+    struct PlacedRootBucket
+    {
+        std::multimap<long long, PlacedRoot> RootsByStart;
+        long long LongestDuration = 0LL;
+    };
+
+    // where the subtrees we're in end, along with the ThreadId their entry got
+    typedef std::vector<std::pair<size_t, unsigned long>> TOpenParents;
+
+    void RemapRootsProcessId(const ExecutionHierarchy::Layout& layout);
+    void PlaceRootsCompactly(const ExecutionHierarchy::Layout& layout);
+    void PlaceRootCompactly(const ExecutionHierarchy::Layout& layout, size_t rootPosition);
+    unsigned long GetRequiredThreadCount(unsigned long long rootId) const;
+    void RemapStable(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Layout& layout, size_t rootPosition);
+
+    void RemapEntriesThreadId(const ExecutionHierarchy::Layout& layout);
+    void RemapThreadIds(const ExecutionHierarchy::Layout& layout, size_t rootPosition, TOpenParents& openParents);
+
+    void CalculateChildrenLocalThreadId(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Entry* entry);
+    void CalculateChildrenExtraThreadIdToFitHierarchy(const ExecutionHierarchy* hierarchy, const ExecutionHierarchy::Entry* entry);
+
+    void NameProcess(unsigned long processId, const std::string& name);
+    void NameThread(unsigned long processId, unsigned long threadId, const std::string& name);
+
+    Strategy strategy_;
+
+    // aligned with the positions of the layout
+    std::vector<Remap> remaps_;
     std::unordered_map<unsigned long long, LocalOffsetData> localOffsetsData_;
+
+    // roots keep theirs between calls to CalculateForRoot, children's get reused from parent to parent
+    LaneAssigner rootLanes_;
+    LaneAssigner childrenLanes_;
+    // scratch buffer for CalculateForRoot
+    TOpenParents openParents_;
+
+    // COMPACT: roots placed so far, by duration (when streaming, only those that may still overlap upcoming ones)
+    std::vector<PlacedRootBucket> placedRootBuckets_;
+
+    // STABLE: the ids roots got so far, and the next one for roots that can't keep theirs
+    std::unordered_set<unsigned long> stableProcessIds_;
+    unsigned long nextMovedProcessId_;
+
+    std::vector<ProcessName> processNames_;
+    std::vector<ThreadName> threadNames_;
+    std::unordered_set<unsigned long> namedProcesses_;
+    std::unordered_set<unsigned long long> namedThreads_;
 };
 
 } // namespace vcperf
@@ -0,0 +1,494 @@
+#include "PerfettoTraceWriter.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <ostream>
+
+using namespace vcperf;
+
+namespace
+{
+    // the buffer gets handed to the stream once it grows past this size
+    constexpr size_t FlushThreshold = 1 << 20;
+
+    // every packet we write belongs to the same sequence
+    constexpr unsigned long long SequenceId = 1ULL;
+
+    // sequence-scoped clocks must use ids in the [64, 127] range
+    constexpr unsigned long long IncrementalClockId = 64ULL;
+    constexpr unsigned long long BootTimeClockId = 6ULL;
+
+    // shorter values take about as many bytes to reference as to write
+    constexpr size_t MinSharedArgSize = 32;
+
+    // field numbers, as defined in Perfetto's protos/perfetto/trace/*.proto
+    namespace Field
+    {
+        constexpr unsigned int TracePacket = 1;
+
+        namespace Packet
+        {
+            constexpr unsigned int ClockSnapshot = 6;
+            constexpr unsigned int Timestamp = 8;
+            constexpr unsigned int TrustedPacketSequenceId = 10;
+            constexpr unsigned int TrackEvent = 11;
+            constexpr unsigned int InternedData = 12;
+            constexpr unsigned int SequenceFlags = 13;
+            constexpr unsigned int TracePacketDefaults = 59;
+            constexpr unsigned int TrackDescriptor = 60;
+        }
+
+        namespace ClockSnapshot
+        {
+            constexpr unsigned int Clocks = 1;
+        }
+
+        namespace Clock
+        {
+            constexpr unsigned int ClockId = 1;
+            constexpr unsigned int Timestamp = 2;
+            constexpr unsigned int IsIncremental = 3;
+            constexpr unsigned int UnitMultiplierNs = 4;
+        }
+
+        namespace TracePacketDefaults
+        {
+            constexpr unsigned int TimestampClockId = 58;
+        }
+
+        namespace TrackDescriptor
+        {
+            constexpr unsigned int Uuid = 1;
+            constexpr unsigned int Process = 3;
+            constexpr unsigned int Thread = 4;
+            constexpr unsigned int ParentUuid = 5;
+        }
+
+        namespace ProcessDescriptor
+        {
+            constexpr unsigned int Pid = 1;
+            constexpr unsigned int ProcessName = 6;
+        }
+
+        namespace ThreadDescriptor
+        {
+            constexpr unsigned int Pid = 1;
+            constexpr unsigned int Tid = 2;
+            constexpr unsigned int ThreadName = 5;
+        }
+
+        namespace TrackEvent
+        {
+            constexpr unsigned int DebugAnnotations = 4;
+            constexpr unsigned int Type = 9;
+            constexpr unsigned int NameIid = 10;
+            constexpr unsigned int TrackUuid = 11;
+        }
+
+        namespace DebugAnnotation
+        {
+            constexpr unsigned int NameIid = 1;
+            constexpr unsigned int StringValue = 6;
+            constexpr unsigned int ArrayValues = 12;
+            constexpr unsigned int StringValueIid = 17;
+        }
+
+        namespace InternedData
+        {
+            constexpr unsigned int EventNames = 2;
+            constexpr unsigned int DebugAnnotationNames = 3;
+            constexpr unsigned int DebugAnnotationStringValues = 29;
+        }
+
+        namespace InternedString
+        {
+            constexpr unsigned int Iid = 1;
+            constexpr unsigned int Name = 2;
+        }
+    }
+
+    enum SequenceFlags : unsigned long long
+    {
+        SEQ_INCREMENTAL_STATE_CLEARED = 1,
+        SEQ_NEEDS_INCREMENTAL_STATE = 2
+    };
+
+    enum TrackEventType : unsigned long long
+    {
+        TYPE_SLICE_BEGIN = 1,
+        TYPE_SLICE_END = 2
+    };
+
+    enum WireType : unsigned int
+    {
+        WIRE_TYPE_VARINT = 0,
+        WIRE_TYPE_LENGTH_DELIMITED = 2
+    };
+
+    void AppendVarint(std::string& message, unsigned long long value)
+    {
+        while (value >= 0x80)
+        {
+            message.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        message.push_back(static_cast<char>(value));
+    }
+
+    void AppendVarintField(std::string& message, unsigned int field, unsigned long long value)
+    {
+        AppendVarint(message, (static_cast<unsigned long long>(field) << 3) | WIRE_TYPE_VARINT);
+        AppendVarint(message, value);
+    }
+
+    void AppendBytesField(std::string& message, unsigned int field, const std::string& value)
+    {
+        AppendVarint(message, (static_cast<unsigned long long>(field) << 3) | WIRE_TYPE_LENGTH_DELIMITED);
+        AppendVarint(message, value.size());
+        message.append(value);
+    }
+
+    long long ToMicroseconds(std::chrono::nanoseconds timestamp)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(timestamp).count();
+    }
+
+    // track uuids only need to be unique within the trace: derive them from the (remapped) ids
+    unsigned long long ProcessTrackUuid(unsigned long processId)
+    {
+        return (static_cast<unsigned long long>(processId) + 1ULL) << 32;
+    }
+
+    unsigned long long ThreadTrackUuid(unsigned long processId, unsigned long threadId)
+    {
+        return ProcessTrackUuid(processId) | (static_cast<unsigned long long>(threadId) + 1ULL);
+    }
+
+}  // anonymous namespace
+
+PerfettoTraceWriter::PerfettoTraceWriter(std::ostream& outputStream, const StringInterner& strings, const SymbolNameStore& symbolNames,
+                                         const TickConverter& tickConverter, bool shareArgs) :
+    outputStream_{outputStream},
+    strings_{strings},
+    symbolNames_{symbolNames},
+    tickConverter_{tickConverter},
+    shareArgs_{shareArgs},
+    buffer_{},
+    pendingEvents_{},
+    depth_{0U},
+    isFirstPacket_{true},
+    lastTimestamp_{0LL},
+    eventNameIds_{},
+    annotationNameIds_{},
+    annotationValueIds_{},
+    describedProcesses_{},
+    describedThreads_{},
+    processNames_{},
+    threadNames_{},
+    packet_{},
+    trackEvent_{},
+    internedData_{},
+    internedString_{},
+    eventName_{},
+    message_{},
+    nestedMessage_{},
+    arrayValue_{}
+{
+    buffer_.reserve(FlushThreshold + FlushThreshold / 4);
+}
+
+void PerfettoTraceWriter::BeginTrace()
+{
+    // a Perfetto trace is a plain sequence of packets, without any header
+}
+
+void PerfettoTraceWriter::EndTrace()
+{
+    assert(depth_ == 0U);
+    FlushPendingEvents();
+    Flush();
+}
+
+void PerfettoTraceWriter::WriteProcessName(unsigned long processId, std::string_view name)
+{
+    processNames_.emplace(processId, name);
+}
+
+void PerfettoTraceWriter::WriteThreadName(unsigned long processId, unsigned long threadId, std::string_view name)
+{
+    threadNames_.emplace(ThreadTrackUuid(processId, threadId), name);
+}
+
+void PerfettoTraceWriter::WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    AddPendingEvent(ToMicroseconds(tickConverter_.ToNanoseconds(entry->StartTimestamp)), entry, processId, threadId, true);
+    ++depth_;
+}
+
+void PerfettoTraceWriter::WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    assert(depth_ > 0U);
+    --depth_;
+    AddPendingEvent(ToMicroseconds(tickConverter_.ToNanoseconds(entry->StopTimestamp)), entry, processId, threadId, false);
+
+    if (depth_ == 0U) {
+        FlushPendingEvents();
+    }
+}
+
+void PerfettoTraceWriter::WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId)
+{
+    // slices are always represented as a Begin/End pair
+    AddPendingEvent(ToMicroseconds(tickConverter_.ToNanoseconds(entry->StartTimestamp)), entry, processId, threadId, true);
+    AddPendingEvent(ToMicroseconds(tickConverter_.ToNanoseconds(entry->StopTimestamp)), entry, processId, threadId, false);
+
+    if (depth_ == 0U) {
+        FlushPendingEvents();
+    }
+}
+
+void PerfettoTraceWriter::AddPendingEvent(long long timestamp, const ExecutionHierarchy::Entry* entry,
+                                          unsigned long processId, unsigned long threadId, bool isBegin)
+{
+    PendingEvent& event = pendingEvents_.emplace_back();
+    event.Timestamp = timestamp;
+    event.Entry = entry;
+    event.ProcessId = processId;
+    event.ThreadId = threadId;
+    event.IsBegin = isBegin;
+}
+
+void PerfettoTraceWriter::FlushPendingEvents()
+{
+    // timestamps are delta-encoded, so write them in chronological order (a stable sort keeps nesting
+    // intact for events that share a timestamp, as they were added in depth-first order)
+    std::stable_sort(pendingEvents_.begin(), pendingEvents_.end(), [](const PendingEvent& lhs, const PendingEvent& rhs) {
+        return lhs.Timestamp < rhs.Timestamp;
+    });
+
+    for (const PendingEvent& event : pendingEvents_) {
+        WriteEvent(event);
+    }
+
+    pendingEvents_.clear();
+}
+
+void PerfettoTraceWriter::WriteEvent(const PendingEvent& event)
+{
+    // roots may overlap, so a root's first event can be older than the previous root's last one: as
+    // deltas can't be negative, re-anchor the incremental clock when that happens
+    if (isFirstPacket_ || event.Timestamp < lastTimestamp_) {
+        WriteClockSnapshot(event.Timestamp, isFirstPacket_);
+    }
+
+    WriteTrackDescriptors(event.ProcessId, event.ThreadId);
+
+    internedData_.clear();
+    trackEvent_.clear();
+    AppendVarintField(trackEvent_, Field::TrackEvent::Type, event.IsBegin ? TYPE_SLICE_BEGIN : TYPE_SLICE_END);
+    AppendVarintField(trackEvent_, Field::TrackEvent::TrackUuid, ThreadTrackUuid(event.ProcessId, event.ThreadId));
+
+    if (event.IsBegin)
+    {
+        AppendVarintField(trackEvent_, Field::TrackEvent::NameIid, InternEventName(event.Entry->GetName(symbolNames_, eventName_)));
+
+        for (const ExecutionHierarchy::Property& property : event.Entry->Properties)
+        {
+            nestedMessage_.clear();
+            AppendVarintField(nestedMessage_, Field::DebugAnnotation::NameIid, InternAnnotationName(property.Key));
+
+            if (!property.IsList) {
+                AppendAnnotationValue(nestedMessage_, property.Value);
+            }
+            else
+            {
+                // each element is an unnamed annotation of its own
+                for (StringInterner::TStringId value : event.Entry->PropertyLists[property.Value])
+                {
+                    arrayValue_.clear();
+                    AppendAnnotationValue(arrayValue_, value);
+                    AppendBytesField(nestedMessage_, Field::DebugAnnotation::ArrayValues, arrayValue_);
+                }
+            }
+
+            AppendBytesField(trackEvent_, Field::TrackEvent::DebugAnnotations, nestedMessage_);
+        }
+    }
+
+    packet_.clear();
+    AppendVarintField(packet_, Field::Packet::Timestamp, static_cast<unsigned long long>(event.Timestamp - lastTimestamp_));
+    AppendVarintField(packet_, Field::Packet::TrustedPacketSequenceId, SequenceId);
+    AppendVarintField(packet_, Field::Packet::SequenceFlags, SEQ_NEEDS_INCREMENTAL_STATE);
+    if (!internedData_.empty()) {
+        AppendBytesField(packet_, Field::Packet::InternedData, internedData_);
+    }
+    AppendBytesField(packet_, Field::Packet::TrackEvent, trackEvent_);
+    WritePacket();
+
+    lastTimestamp_ = event.Timestamp;
+}
+
+void PerfettoTraceWriter::WriteTrackDescriptors(unsigned long processId, unsigned long threadId)
+{
+    if (describedProcesses_.insert(processId).second)
+    {
+        message_.clear();
+        AppendVarintField(message_, Field::ProcessDescriptor::Pid, processId);
+
+        auto itName = processNames_.find(processId);
+        if (itName != processNames_.end()) {
+            AppendBytesField(message_, Field::ProcessDescriptor::ProcessName, itName->second);
+        }
+
+        nestedMessage_.clear();
+        AppendVarintField(nestedMessage_, Field::TrackDescriptor::Uuid, ProcessTrackUuid(processId));
+        AppendBytesField(nestedMessage_, Field::TrackDescriptor::Process, message_);
+
+        packet_.clear();
+        AppendVarintField(packet_, Field::Packet::TrustedPacketSequenceId, SequenceId);
+        AppendBytesField(packet_, Field::Packet::TrackDescriptor, nestedMessage_);
+        WritePacket();
+    }
+
+    if (describedThreads_.insert(ThreadTrackUuid(processId, threadId)).second)
+    {
+        message_.clear();
+        AppendVarintField(message_, Field::ThreadDescriptor::Pid, processId);
+        AppendVarintField(message_, Field::ThreadDescriptor::Tid, threadId);
+
+        auto itName = threadNames_.find(ThreadTrackUuid(processId, threadId));
+        if (itName != threadNames_.end()) {
+            AppendBytesField(message_, Field::ThreadDescriptor::ThreadName, itName->second);
+        }
+
+        nestedMessage_.clear();
+        AppendVarintField(nestedMessage_, Field::TrackDescriptor::Uuid, ThreadTrackUuid(processId, threadId));
+        AppendVarintField(nestedMessage_, Field::TrackDescriptor::ParentUuid, ProcessTrackUuid(processId));
+        AppendBytesField(nestedMessage_, Field::TrackDescriptor::Thread, message_);
+
+        packet_.clear();
+        AppendVarintField(packet_, Field::Packet::TrustedPacketSequenceId, SequenceId);
+        AppendBytesField(packet_, Field::Packet::TrackDescriptor, nestedMessage_);
+        WritePacket();
+    }
+}
+
+void PerfettoTraceWriter::WriteClockSnapshot(long long timestamp, bool clearIncrementalState)
+{
+    // our incremental clock ticks in microseconds, as the .json output does
+    message_.clear();
+    AppendVarintField(message_, Field::Clock::ClockId, IncrementalClockId);
+    AppendVarintField(message_, Field::Clock::Timestamp, static_cast<unsigned long long>(timestamp));
+    AppendVarintField(message_, Field::Clock::IsIncremental, 1ULL);
+    AppendVarintField(message_, Field::Clock::UnitMultiplierNs, 1000ULL);
+
+    nestedMessage_.clear();
+    AppendBytesField(nestedMessage_, Field::ClockSnapshot::Clocks, message_);
+
+    message_.clear();
+    AppendVarintField(message_, Field::Clock::ClockId, BootTimeClockId);
+    AppendVarintField(message_, Field::Clock::Timestamp, static_cast<unsigned long long>(timestamp) * 1000ULL);
+    AppendBytesField(nestedMessage_, Field::ClockSnapshot::Clocks, message_);
+
+    packet_.clear();
+    AppendVarintField(packet_, Field::Packet::TrustedPacketSequenceId, SequenceId);
+    AppendBytesField(packet_, Field::Packet::ClockSnapshot, nestedMessage_);
+
+    if (clearIncrementalState)
+    {
+        // make every following packet on the sequence default to our incremental clock
+        message_.clear();
+        AppendVarintField(message_, Field::TracePacketDefaults::TimestampClockId, IncrementalClockId);
+
+        AppendVarintField(packet_, Field::Packet::SequenceFlags, SEQ_INCREMENTAL_STATE_CLEARED);
+        AppendBytesField(packet_, Field::Packet::TracePacketDefaults, message_);
+    }
+
+    WritePacket();
+
+    isFirstPacket_ = false;
+    lastTimestamp_ = timestamp;
+}
+
+unsigned long long PerfettoTraceWriter::InternEventName(const std::string& name)
+{
+    auto result = eventNameIds_.try_emplace(name, eventNameIds_.size() + 1);
+    if (result.second)
+    {
+        // first time we see this name: let the packet carry its definition
+        internedString_.clear();
+        AppendVarintField(internedString_, Field::InternedString::Iid, result.first->second);
+        AppendBytesField(internedString_, Field::InternedString::Name, name);
+        AppendBytesField(internedData_, Field::InternedData::EventNames, internedString_);
+    }
+
+    return result.first->second;
+}
+
+unsigned long long PerfettoTraceWriter::InternAnnotationName(StringInterner::TStringId name)
+{
+    if (name >= annotationNameIds_.size()) {
+        annotationNameIds_.resize(strings_.GetCount(), 0ULL);
+    }
+
+    unsigned long long& iid = annotationNameIds_[name];
+    if (iid == 0ULL)
+    {
+        // iids only need to be unique, so reuse the interner's id (but 0 is reserved)
+        iid = static_cast<unsigned long long>(name) + 1ULL;
+
+        internedString_.clear();
+        AppendVarintField(internedString_, Field::InternedString::Iid, iid);
+        AppendBytesField(internedString_, Field::InternedString::Name, strings_.GetString(name));
+        AppendBytesField(internedData_, Field::InternedData::DebugAnnotationNames, internedString_);
+    }
+
+    return iid;
+}
+
+void PerfettoTraceWriter::AppendAnnotationValue(std::string& annotation, StringInterner::TStringId value)
+{
+    const std::string& valueString = strings_.GetString(value);
+    if (shareArgs_ && valueString.size() >= MinSharedArgSize) {
+        AppendVarintField(annotation, Field::DebugAnnotation::StringValueIid, InternAnnotationValue(value));
+    }
+    else {
+        AppendBytesField(annotation, Field::DebugAnnotation::StringValue, valueString);
+    }
+}
+
+unsigned long long PerfettoTraceWriter::InternAnnotationValue(StringInterner::TStringId value)
+{
+    if (value >= annotationValueIds_.size()) {
+        annotationValueIds_.resize(strings_.GetCount(), 0ULL);
+    }
+
+    unsigned long long& iid = annotationValueIds_[value];
+    if (iid == 0ULL)
+    {
+        // values get an iid space of their own, so the interner's id works here too
+        iid = static_cast<unsigned long long>(value) + 1ULL;
+
+        internedString_.clear();
+        AppendVarintField(internedString_, Field::InternedString::Iid, iid);
+        AppendBytesField(internedString_, Field::InternedString::Name, strings_.GetString(value));
+        AppendBytesField(internedData_, Field::InternedData::DebugAnnotationStringValues, internedString_);
+    }
+
+    return iid;
+}
+
+void PerfettoTraceWriter::WritePacket()
+{
+    AppendBytesField(buffer_, Field::TracePacket, packet_);
+
+    if (buffer_.size() >= FlushThreshold) {
+        Flush();
+    }
+}
+
+void PerfettoTraceWriter::Flush()
+{
+    outputStream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "TimeTrace\ExecutionHierarchy.h"
+#include "TimeTrace\StringInterner.h"
+#include "TimeTrace\SymbolNameStore.h"
+#include "TimeTrace\TickConverter.h"
+#include "TimeTrace\TraceWriter.h"
+
+namespace vcperf
+{
+
+// writes Perfetto's native protobuf format: a single packet sequence of TrackEvents, with interned names
+// and timestamps delta-encoded through an incremental clock
+class PerfettoTraceWriter : public TraceWriter
+{
+public:
+
+    // with shareArgs, long property values get interned like names are, so each one is only written once
+    PerfettoTraceWriter(std::ostream& outputStream, const StringInterner& strings, const SymbolNameStore& symbolNames,
+                        const TickConverter& tickConverter, bool shareArgs);
+
+    void BeginTrace() override;
+    void EndTrace() override;
+
+    void WriteProcessName(unsigned long processId, std::string_view name) override;
+    void WriteThreadName(unsigned long processId, unsigned long threadId, std::string_view name) override;
+
+    void WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+    void WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+    void WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) override;
+
+private:
+
+    struct PendingEvent
+    {
+        long long Timestamp = 0LL;
+        const ExecutionHierarchy::Entry* Entry = nullptr;
+        unsigned long ProcessId = 0UL;
+        unsigned long ThreadId = 0UL;
+        bool IsBegin = false;
+    };
+
+    void AddPendingEvent(long long timestamp, const ExecutionHierarchy::Entry* entry,
+                         unsigned long processId, unsigned long threadId, bool isBegin);
+    void FlushPendingEvents();
+
+    void WriteEvent(const PendingEvent& event);
+    void WriteTrackDescriptors(unsigned long processId, unsigned long threadId);
+    void WriteClockSnapshot(long long timestamp, bool clearIncrementalState);
+
+    unsigned long long InternEventName(const std::string& name);
+    unsigned long long InternAnnotationName(StringInterner::TStringId name);
+    unsigned long long InternAnnotationValue(StringInterner::TStringId value);
+    void AppendAnnotationValue(std::string& annotation, StringInterner::TStringId value);
+
+    void WritePacket();
+    void Flush();
+
+    std::ostream& outputStream_;
+    const StringInterner& strings_;
+    const SymbolNameStore& symbolNames_;
+    const TickConverter& tickConverter_;
+    bool shareArgs_;
+    std::string buffer_;
+
+    // events get sorted by timestamp before being written, one root at a time
+    std::vector<PendingEvent> pendingEvents_;
+    unsigned int depth_;
+
+    bool isFirstPacket_;
+    long long lastTimestamp_;
+
+    std::unordered_map<std::string, unsigned long long> eventNameIds_;
+    // indexed by property key, 0 when not interned yet
+    std::vector<unsigned long long> annotationNameIds_;
+    std::vector<unsigned long long> annotationValueIds_;
+    std::unordered_set<unsigned long> describedProcesses_;
+    std::unordered_set<unsigned long long> describedThreads_;
+    // names go into the track descriptors, which only get written once the track is used
+    std::unordered_map<unsigned long, std::string> processNames_;
+    std::unordered_map<unsigned long long, std::string> threadNames_;
+
+    // scratch buffers, reused between packets to avoid allocations
+    std::string packet_;
+    std::string trackEvent_;
+    std::string internedData_;
+    std::string internedString_;
+    std::string eventName_;
+    std::string message_;
+    std::string nestedMessage_;
+    std::string arrayValue_;
+};
+
+} // namespace vcperf
@@ -0,0 +1,27 @@
+#include "StringInterner.h"
+
+#include <assert.h>
+
+using namespace vcperf;
+
+StringInterner::StringInterner() :
+    strings_{},
+    ids_{}
+{
+}
+
+StringInterner::TStringId StringInterner::Intern(std::string_view value)
+{
+    auto it = ids_.find(value);
+    if (it != ids_.end()) {
+        return it->second;
+    }
+
+    assert(strings_.size() < static_cast<TStringId>(~0U));
+
+    TStringId id = static_cast<TStringId>(strings_.size());
+    const std::string& storedValue = strings_.emplace_back(value);
+    ids_.emplace(storedValue, id);
+
+    return id;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace vcperf
+{
+
+// keeps a single copy of every distinct string, which then gets referred to by a small id (i.e. the
+// same PATH value shared by thousands of invocations only gets stored once)
+class StringInterner
+{
+public:
+
+    typedef unsigned int TStringId;
+
+public:
+
+    StringInterner();
+
+    TStringId Intern(std::string_view value);
+
+    // ids are dense: they go from 0 to GetCount() - 1, in interning order
+    inline const std::string& GetString(TStringId id) const { return strings_[id]; }
+    inline size_t GetCount() const { return strings_.size(); }
+
+private:
+
+    // a deque never moves its elements, so the map's keys can point into them
+    std::deque<std::string> strings_;
+    std::unordered_map<std::string_view, TStringId> ids_;
+};
+
+} // namespace vcperf
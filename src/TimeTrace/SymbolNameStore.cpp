@@ -0,0 +1,188 @@
+#include "SymbolNameStore.h"
+
+#include <assert.h>
+
+using namespace vcperf;
+
+namespace
+{
+    // below this, compacting labels isn't worth the trouble
+    constexpr size_t MinCompactedLabelSize = 1 << 16;
+
+}  // anonymous namespace
+
+SymbolNameStore::SymbolNameStore() :
+    nodes_{ Node{} },
+    freeNodes_{},
+    children_{},
+    labels_{},
+    unusedLabelSize_{0}
+{
+}
+
+SymbolNameStore::TNameId SymbolNameStore::Add(std::string_view name)
+{
+    TNameId current = 0;
+    size_t position = 0;
+
+    while (position < name.size())
+    {
+        auto it = children_.find(ChildKey(current, name[position]));
+        if (it == children_.end())
+        {
+            // nothing shares the rest of the name, so it becomes a whole new label
+            assert(labels_.size() + (name.size() - position) < static_cast<size_t>(~0U));
+
+            unsigned int labelOffset = static_cast<unsigned int>(labels_.size());
+            labels_.append(name.substr(position));
+
+            TNameId child = CreateNode(current, labelOffset, static_cast<unsigned int>(name.size() - position));
+            children_.emplace(ChildKey(current, name[position]), child);
+
+            current = child;
+            break;
+        }
+
+        TNameId child = it->second;
+        const Node& node = nodes_[child];
+
+        // first character is already known to match
+        unsigned int matching = 1U;
+        while (matching < node.LabelLength && position + matching < name.size() &&
+               labels_[node.LabelOffset + matching] == name[position + matching])
+        {
+            ++matching;
+        }
+
+        // name ends or goes its own way halfway through the label, which needs a node right there
+        if (matching < node.LabelLength) {
+            child = SplitNode(child, matching);
+        }
+
+        current = child;
+        position += matching;
+    }
+
+    for (TNameId id = current; id != 0; id = nodes_[id].Parent) {
+        ++nodes_[id].References;
+    }
+
+    return current;
+}
+
+void SymbolNameStore::AddReference(TNameId id)
+{
+    for (; id != 0; id = nodes_[id].Parent)
+    {
+        assert(nodes_[id].References > 0);
+        ++nodes_[id].References;
+    }
+}
+
+void SymbolNameStore::Release(TNameId id)
+{
+    while (id != 0)
+    {
+        Node& node = nodes_[id];
+        assert(node.References > 0);
+
+        TNameId parent = node.Parent;
+        if (--node.References == 0)
+        {
+            // anything below already got freed, as it can't have more references than this node
+            children_.erase(ChildKey(parent, labels_[node.LabelOffset]));
+            unusedLabelSize_ += node.LabelLength;
+
+            node.Parent = InvalidId;
+            freeNodes_.push_back(id);
+        }
+
+        id = parent;
+    }
+
+    if (unusedLabelSize_ >= MinCompactedLabelSize && unusedLabelSize_ > labels_.size() / 2) {
+        CompactLabels();
+    }
+}
+
+void SymbolNameStore::GetName(TNameId id, std::string& output) const
+{
+    // filled from the back, walking up from where the name ends
+    size_t end = nodes_[id].Length;
+    output.resize(end);
+
+    for (; id != 0; id = nodes_[id].Parent)
+    {
+        const Node& node = nodes_[id];
+        end -= node.LabelLength;
+        labels_.copy(&output[end], node.LabelLength, node.LabelOffset);
+    }
+
+    assert(end == 0);
+}
+
+SymbolNameStore::TNameId SymbolNameStore::CreateNode(TNameId parent, unsigned int labelOffset, unsigned int labelLength)
+{
+    TNameId id;
+    if (!freeNodes_.empty())
+    {
+        id = freeNodes_.back();
+        freeNodes_.pop_back();
+    }
+    else
+    {
+        assert(nodes_.size() < static_cast<size_t>(InvalidId));
+
+        id = static_cast<TNameId>(nodes_.size());
+        nodes_.emplace_back();
+    }
+
+    Node& node = nodes_[id];
+    node.Parent = parent;
+    node.LabelOffset = labelOffset;
+    node.LabelLength = labelLength;
+    node.Length = nodes_[parent].Length + labelLength;
+    node.References = 0U;
+
+    return id;
+}
+
+SymbolNameStore::TNameId SymbolNameStore::SplitNode(TNameId id, unsigned int prefixLength)
+{
+    assert(prefixLength > 0 && prefixLength < nodes_[id].LabelLength);
+
+    // the node keeps its id (names already refer to it), and gets the new prefix node as parent
+    TNameId parent = nodes_[id].Parent;
+    TNameId prefix = CreateNode(parent, nodes_[id].LabelOffset, prefixLength);
+    nodes_[prefix].References = nodes_[id].References;
+    children_[ChildKey(parent, labels_[nodes_[prefix].LabelOffset])] = prefix;
+
+    Node& node = nodes_[id];
+    node.Parent = prefix;
+    node.LabelOffset += prefixLength;
+    node.LabelLength -= prefixLength;
+    children_.emplace(ChildKey(prefix, labels_[node.LabelOffset]), id);
+
+    return prefix;
+}
+
+void SymbolNameStore::CompactLabels()
+{
+    std::string labels;
+    labels.reserve(labels_.size() - unusedLabelSize_);
+
+    // nodes never share characters, so each one simply moves its own
+    for (Node& node : nodes_)
+    {
+        if (node.References == 0U) {
+            continue;
+        }
+
+        unsigned int labelOffset = static_cast<unsigned int>(labels.size());
+        labels.append(labels_, node.LabelOffset, node.LabelLength);
+        node.LabelOffset = labelOffset;
+    }
+
+    labels_.swap(labels);
+    unusedLabelSize_ = 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace vcperf
+{
+
+// keeps template instantiation names in a radix tree, so the long prefixes they share (i.e. "std::basic_string<char,")
+// only get stored once, and each distinct name is a small id (the node it ends at) that entries refer to
+// names are reference counted: once nothing refers to them, their nodes get reused and their characters compacted away
+class SymbolNameStore
+{
+public:
+
+    typedef unsigned int TNameId;
+
+    static constexpr TNameId InvalidId = ~0U;
+
+public:
+
+    SymbolNameStore();
+
+    // the returned id holds a reference to the name, to be given back through Release
+    TNameId Add(std::string_view name);
+    void AddReference(TNameId id);
+    void Release(TNameId id);
+
+    // replaces output's contents with the name
+    void GetName(TNameId id, std::string& output) const;
+    inline size_t GetLength(TNameId id) const { return nodes_[id].Length; }
+
+private:
+
+    struct Node
+    {
+        TNameId Parent = InvalidId;
+        // where the node's part of the name lives in labels_
+        unsigned int LabelOffset = 0U;
+        unsigned int LabelLength = 0U;
+        // length of the whole name ending at this node
+        unsigned int Length = 0U;
+        // references to this node's name and all names below it, the node is free once it drops to 0
+        unsigned int References = 0U;
+    };
+
+    // children are found by their parent and the first character of their label
+    static inline unsigned long long ChildKey(TNameId parent, char firstCharacter)
+    {
+        return (static_cast<unsigned long long>(parent) << 8) | static_cast<unsigned char>(firstCharacter);
+    }
+
+    TNameId CreateNode(TNameId parent, unsigned int labelOffset, unsigned int labelLength);
+    TNameId SplitNode(TNameId id, unsigned int prefixLength);
+    void CompactLabels();
+
+    // node 0 is the root, which stands for the empty name and never gets freed
+    std::vector<Node> nodes_;
+    std::vector<TNameId> freeNodes_;
+    std::unordered_map<unsigned long long, TNameId> children_;
+    std::string labels_;
+    // characters in labels_ that belong to freed nodes
+    size_t unusedLabelSize_;
+};
+
+} // namespace vcperf
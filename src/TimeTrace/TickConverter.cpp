@@ -0,0 +1,112 @@
+#include "TickConverter.h"
+
+#include <algorithm>
+#include <limits>
+
+using namespace vcperf;
+
+namespace
+{
+    constexpr long long NanosecondsPerSecond = std::chrono::nanoseconds::period::den;
+
+    // remainder / frequency as a 64-bit fixed-point fraction, rounded up: a long division, one bit at a time
+    // (remainders stay under the frequency, so shifting them never overflows)
+    unsigned long long DivideRemainder(unsigned long long remainder, unsigned long long frequency)
+    {
+        unsigned long long fraction = 0ULL;
+        for (int bit = 0; bit < 64; ++bit)
+        {
+            remainder <<= 1;
+            fraction <<= 1;
+
+            if (remainder >= frequency)
+            {
+                remainder -= frequency;
+                fraction |= 1ULL;
+            }
+        }
+
+        if (remainder > 0) {
+            ++fraction;
+        }
+
+        return fraction;
+    }
+
+}  // anonymous namespace
+
+TickConverter::TickConverter() :
+    frequency_{0LL},
+    origin_{0LL},
+    wholeNanosecondsPerTick_{0LL},
+    fractionalNanosecondsPerTick_{0ULL},
+    exactTickLimit_{std::numeric_limits<long long>::max()},
+    originNanoseconds_{0LL},
+    originFractionalNanoseconds_{0ULL},
+    originTickLimit_{std::numeric_limits<long long>::max()}
+{
+}
+
+TickConverter::TickConverter(long long frequency, long long origin) :
+    frequency_{frequency},
+    origin_{origin},
+    wholeNanosecondsPerTick_{0LL},
+    fractionalNanosecondsPerTick_{0ULL},
+    exactTickLimit_{0LL},
+    originNanoseconds_{0LL},
+    originFractionalNanoseconds_{0ULL},
+    originTickLimit_{0LL}
+{
+    if (frequency_ <= 0) {
+        return;
+    }
+
+    const unsigned long long unsignedFrequency = static_cast<unsigned long long>(frequency_);
+    wholeNanosecondsPerTick_ = NanosecondsPerSecond / frequency_;
+    fractionalNanosecondsPerTick_ = DivideRemainder(static_cast<unsigned long long>(NanosecondsPerSecond % frequency_), unsignedFrequency);
+
+    // rounding the fraction up adds an error under ticks / 2^64, which can't reach the next whole nanosecond
+    // as long as it stays under 1 / frequency
+    unsigned long long exactTickLimit = std::numeric_limits<unsigned long long>::max() / unsignedFrequency;
+
+    // and the whole part must not overflow
+    exactTickLimit = std::min(exactTickLimit, static_cast<unsigned long long>(std::numeric_limits<long long>::max() / (wholeNanosecondsPerTick_ + 1)));
+
+    exactTickLimit_ = static_cast<long long>(exactTickLimit);
+
+    // timestamps past the origin add the origin's fraction, rounded up as well: that's one more tick's worth of error,
+    // which stays under 1 / frequency as long as they're under the same limit, and the sum must not overflow either
+    if (origin_ >= 0)
+    {
+        originNanoseconds_ = ToNanosecondsWithDivisions(origin_).count();
+        unsigned long long originRemainder = static_cast<unsigned long long>((origin_ % frequency_) * NanosecondsPerSecond % frequency_);
+        originFractionalNanoseconds_ = DivideRemainder(originRemainder, unsignedFrequency);
+
+        originTickLimit_ = std::min(exactTickLimit_, (std::numeric_limits<long long>::max() - originNanoseconds_) / (wholeNanosecondsPerTick_ + 1));
+    }
+}
+
+long long TickConverter::FromNanoseconds(std::chrono::nanoseconds time) const
+{
+    if (frequency_ <= 0 || time.count() <= 0) {
+        return 0LL;
+    }
+
+    // rounds up, splitting whole seconds apart so nothing overflows
+    long long seconds = time.count() / NanosecondsPerSecond;
+    long long nanoseconds = time.count() % NanosecondsPerSecond;
+
+    return seconds * frequency_ + (nanoseconds * frequency_ + NanosecondsPerSecond - 1) / NanosecondsPerSecond;
+}
+
+std::chrono::nanoseconds TickConverter::ToNanosecondsWithDivisions(long long ticks) const
+{
+    if (frequency_ <= 0) {
+        return std::chrono::nanoseconds{ 0 };
+    }
+
+    long long p1 = (ticks / frequency_) * NanosecondsPerSecond;
+    long long p2 = (ticks % frequency_) * NanosecondsPerSecond / frequency_;
+
+    return std::chrono::nanoseconds{ p1 + p2 };
+}
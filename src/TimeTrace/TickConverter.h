@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    #include <intrin.h>
+#endif
+
+namespace vcperf
+{
+
+// converts the trace's raw timestamps, ticks of a single frequency, to nanoseconds: whole nanoseconds per tick
+// plus a 64-bit fixed-point fraction, so it takes a multiply-high where a plain conversion takes two divisions,
+// and gives the same result for anything under 2^64 / frequency ticks (51 hours at the usual 10MHz)
+// timestamps count from boot rather than from the start of the trace, so they go through the same math relative
+// to the origin, whose own conversion only gets done once, with divisions
+class TickConverter
+{
+public:
+
+    // without a frequency, everything converts to 0
+    TickConverter();
+    TickConverter(long long frequency, long long origin = 0LL);
+
+    inline long long GetFrequency() const { return frequency_; }
+    // the trace's first timestamp, for those who want times relative to the start of the trace
+    inline long long GetOrigin() const { return origin_; }
+
+    inline std::chrono::nanoseconds ToNanoseconds(long long ticks) const
+    {
+        if (ticks >= origin_ && ticks - origin_ < originTickLimit_)
+        {
+            // the origin's fraction gets added in before dropping it, as the two may add up to a whole nanosecond
+            unsigned long long elapsedTicks = static_cast<unsigned long long>(ticks - origin_);
+            unsigned long long fractionLow = elapsedTicks * fractionalNanosecondsPerTick_;
+            unsigned long long fraction = MultiplyHigh(elapsedTicks, fractionalNanosecondsPerTick_);
+            if (fractionLow + originFractionalNanoseconds_ < fractionLow) {
+                ++fraction;
+            }
+
+            return std::chrono::nanoseconds{ originNanoseconds_ + static_cast<long long>(elapsedTicks) * wholeNanosecondsPerTick_
+                                             + static_cast<long long>(fraction) };
+        }
+
+        if (ticks >= 0 && ticks < exactTickLimit_)
+        {
+            unsigned long long fraction = MultiplyHigh(static_cast<unsigned long long>(ticks), fractionalNanosecondsPerTick_);
+            return std::chrono::nanoseconds{ ticks * wholeNanosecondsPerTick_ + static_cast<long long>(fraction) };
+        }
+
+        return ToNanosecondsWithDivisions(ticks);
+    }
+
+    // the fewest ticks that convert to at least the given time
+    long long FromNanoseconds(std::chrono::nanoseconds time) const;
+
+private:
+
+    static inline unsigned long long MultiplyHigh(unsigned long long lhs, unsigned long long rhs)
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+        return __umulh(lhs, rhs);
+#elif defined(__SIZEOF_INT128__)
+        return static_cast<unsigned long long>((static_cast<unsigned __int128>(lhs) * rhs) >> 64);
+#else
+        unsigned long long lhsLow = lhs & 0xFFFFFFFFULL;
+        unsigned long long lhsHigh = lhs >> 32;
+        unsigned long long rhsLow = rhs & 0xFFFFFFFFULL;
+        unsigned long long rhsHigh = rhs >> 32;
+
+        unsigned long long middle = lhsHigh * rhsLow + ((lhsLow * rhsLow) >> 32);
+        unsigned long long otherMiddle = lhsLow * rhsHigh + (middle & 0xFFFFFFFFULL);
+
+        return lhsHigh * rhsHigh + (middle >> 32) + (otherMiddle >> 32);
+#endif
+    }
+
+    std::chrono::nanoseconds ToNanosecondsWithDivisions(long long ticks) const;
+
+    long long frequency_;
+    long long origin_;
+    long long wholeNanosecondsPerTick_;
+    // scaled by 2^64, rounded up
+    unsigned long long fractionalNanosecondsPerTick_;
+    long long exactTickLimit_;
+
+    // the origin's conversion, split the same way, and how far past it the fast path stays exact
+    long long originNanoseconds_;
+    unsigned long long originFractionalNanoseconds_;
+    long long originTickLimit_;
+};
+
+} // namespace vcperf
@@ -1,121 +1,231 @@
 #include "TimeTraceGenerator.h"
 
+#include <algorithm>
+#include <assert.h>
+#include <condition_variable>
 #include <fstream>
-#include <nlohmann\json.hpp>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "TimeTrace\FoldedStackWriter.h"
+#include "TimeTrace\JsonTraceWriter.h"
+#include "TimeTrace\PerfettoTraceWriter.h"
+#include "TimeTrace\TraceOutputStream.h"
 
 using namespace Microsoft::Cpp::BuildInsights;
 using namespace Activities;
 using namespace vcperf;
 
-// anonymous namespace to hold auxiliary functions (instead of using it in the class and requiring #include <nlohmann\json.hpp>
 namespace
 {
 
-void AddEntry(const ExecutionHierarchy::Entry* entry, nlohmann::json& traceEvents, const PackedProcessThreadRemapping& remappings)
+// when splitting by size, the trace gets divided in this many slices of time to estimate where the cuts go
+constexpr int SizeEstimationBucketCount = 4096;
+
+// when exporting on several threads, roots get handed over in batches of at least this many entries, and each
+// worker can have this many batches waiting to be appended to the output
+constexpr size_t MinBatchEntryCount = 4096;
+constexpr size_t SlotsPerWorker = 2;
+
+// overviews only keep invocations and their passes (i.e. FrontEndPass)
+constexpr size_t OverviewDepthCount = 2;
+
+// the output format gets selected by the output file's extension (ignoring the compression one, if any)
+bool IsPerfettoTrace(const std::filesystem::path& outputFile)
+{
+    return TraceOutputStream::RemoveCompressionExtension(outputFile).extension() == L".perfetto-trace";
+}
+
+bool IsFoldedStacks(const std::filesystem::path& outputFile)
+{
+    return TraceOutputStream::RemoveCompressionExtension(outputFile).extension() == L".folded";
+}
+
+std::unique_ptr<TraceWriter> CreateTraceWriter(const std::filesystem::path& outputFile, std::ostream& outputStream,
+                                               const ExecutionHierarchy& hierarchy, const TimeTraceGenerator::Options& options)
 {
-    const PackedProcessThreadRemapping::Remap* remap = remappings.GetRemapFor(entry->Id);
-    unsigned long processId = remap != nullptr ? remap->ProcessId : entry->ProcessId;
-    unsigned long threadId = remap != nullptr ? remap->ThreadId : entry->ThreadId;
+    if (IsFoldedStacks(outputFile)) {
+        return std::make_unique<FoldedStackWriter>(outputStream, hierarchy.GetSymbolNames(), hierarchy.GetTickConverter());
+    }
 
-    if (entry->Children.size() == 0)
+    if (IsPerfettoTrace(outputFile))
     {
-        auto startTimestamp = std::chrono::duration_cast<std::chrono::microseconds>(entry->StartTimestamp);
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(entry->StopTimestamp - entry->StartTimestamp);
-        nlohmann::json completeEvent =
-        {
-            { "ph", "X" },
-            { "pid", processId },
-            { "tid", threadId },
-            { "name", entry->Name },
-            { "ts", startTimestamp.count() },
-            { "dur", duration.count() }
-        };
-
-        // add extra properties, if any
-        if (!entry->Properties.empty())
-        {
-            nlohmann::json args = nlohmann::json::object();
-            for (auto& pair : entry->Properties)
-            {
-                args[pair.first] = pair.second;
-            }
+        return std::make_unique<PerfettoTraceWriter>(outputStream, hierarchy.GetStrings(), hierarchy.GetSymbolNames(),
+                                                     hierarchy.GetTickConverter(), options.ShareArgs);
+    }
 
-            completeEvent["args"] = args;
-        }
+    return std::make_unique<JsonTraceWriter>(outputStream, hierarchy.GetStrings(), hierarchy.GetSymbolNames(),
+                                             hierarchy.GetTickConverter(), options.CompactJson, options.ShareArgs);
+}
+
+long long ToMicroseconds(const TickConverter& tickConverter, long long ticks)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(tickConverter.ToNanoseconds(ticks)).count();
+}
+
+// rough size of the entry's events in the JSON output (the other formats are smaller)
+size_t EstimateSize(const ExecutionHierarchy& hierarchy, const ExecutionHierarchy::Entry* entry, bool hasChildren)
+{
+    const StringInterner& strings = hierarchy.GetStrings();
 
-        traceEvents.push_back(completeEvent);
+    // "ph", "pid", "tid", "ts" and "dur" with their values
+    size_t size = 64 + entry->Name.size();
+    if (entry->SymbolName != SymbolNameStore::InvalidId) {
+        size += hierarchy.GetSymbolNames().GetLength(entry->SymbolName);
     }
-    else
+
+    for (const ExecutionHierarchy::Property& property : entry->Properties)
     {
-        auto startTimestamp = std::chrono::duration_cast<std::chrono::microseconds>(entry->StartTimestamp);
-        nlohmann::json beginEvent =
-        {
-            { "ph", "B" },
-            { "pid", processId },
-            { "tid", threadId },
-            { "name", entry->Name },
-            { "ts", startTimestamp.count() }
-        };
-
-        // add extra properties, if any
-        if (!entry->Properties.empty())
-        {
-            nlohmann::json args = nlohmann::json::object();
-            for (auto& pair : entry->Properties)
-            {
-                args[pair.first] = pair.second;
-            }
+        size += strings.GetString(property.Key).size() + 6;
 
-            beginEvent["args"] = args;
+        if (!property.IsList) {
+            size += strings.GetString(property.Value).size();
+            continue;
         }
 
-        traceEvents.push_back(beginEvent);
-
-        for (const ExecutionHierarchy::Entry* child : entry->Children)
-        {
-            AddEntry(child, traceEvents, remappings);
+        for (StringInterner::TStringId value : entry->PropertyLists[property.Value]) {
+            size += strings.GetString(value).size() + 3;
         }
+    }
 
-        auto stopTimestamp = std::chrono::duration_cast<std::chrono::microseconds>(entry->StopTimestamp);
-        nlohmann::json endEvent =
-        {
-            { "ph", "E" },
-            { "pid", processId },
-            { "tid", threadId },
-            { "ts", stopTimestamp.count() }
-        };
-        traceEvents.push_back(endEvent);
+    // entries with children get an extra end event
+    if (hasChildren) {
+        size += 48;
     }
+
+    return size;
 }
 
 }  // anonymous namespace
 
-TimeTraceGenerator::TimeTraceGenerator(ExecutionHierarchy* hierarchy, const std::filesystem::path& outputFile) :
+bool TimeTraceGenerator::TimeWindow::Contains(long long startTimestamp, long long stopTimestamp) const
+{
+    return startTimestamp >= Start && stopTimestamp <= Stop;
+}
+
+bool TimeTraceGenerator::TimeWindow::Overlaps(long long startTimestamp, long long stopTimestamp) const
+{
+    // zero-length entries only belong to the window they start in
+    if (startTimestamp == stopTimestamp) {
+        return startTimestamp >= Start && startTimestamp < Stop;
+    }
+
+    return startTimestamp < Stop && stopTimestamp > Start;
+}
+
+std::filesystem::path TimeTraceGenerator::GetIndexFile(const std::filesystem::path& outputFile)
+{
+    std::filesystem::path indexFile = TraceOutputStream::RemoveCompressionExtension(outputFile);
+    indexFile.replace_extension(L".index.json");
+
+    return indexFile;
+}
+
+std::filesystem::path TimeTraceGenerator::GetNamesFile(const std::filesystem::path& outputFile)
+{
+    std::filesystem::path namesFile = TraceOutputStream::RemoveCompressionExtension(outputFile);
+    namesFile.replace_extension(L".names.json");
+
+    return namesFile;
+}
+
+std::filesystem::path TimeTraceGenerator::GetChunkFile(const std::filesystem::path& outputFile, size_t chunkIndex)
+{
+    std::filesystem::path uncompressedOutputFile = TraceOutputStream::RemoveCompressionExtension(outputFile);
+
+    // zero-padded, so chunks get listed in order
+    std::wstring number = std::to_wstring(chunkIndex + 1);
+    if (number.size() < 3) {
+        number.insert(0, 3 - number.size(), L'0');
+    }
+
+    std::filesystem::path chunkFile = uncompressedOutputFile;
+    chunkFile.replace_extension(L"." + number);
+    chunkFile += uncompressedOutputFile.extension();
+    chunkFile += outputFile.extension() != uncompressedOutputFile.extension() ? outputFile.extension() : L"";
+
+    return chunkFile;
+}
+
+TimeTraceGenerator::TimeTraceGenerator(ExecutionHierarchy* hierarchy, const std::filesystem::path& outputFile, const Options& options) :
     hierarchy_{hierarchy},
     outputFile_{outputFile},
-    remappings_{}
+    options_{options},
+    remappings_{options.LaneStrategy},
+    writeState_{},
+    streamingOutputStream_{},
+    streamingWriter_{},
+    streamingLayout_{},
+    finishedRoots_{},
+    longNameWriter_{GetNamesFile(outputFile)}
+{
+    assert(!options_.Streaming || !options_.IsSplit());
+
+    hierarchy_->SetLongNameWriter(&longNameWriter_);
+}
+
+TimeTraceGenerator::~TimeTraceGenerator()
+{
+    hierarchy_->SetLongNameWriter(nullptr);
+}
+
+AnalysisControl TimeTraceGenerator::OnBeginAnalysis()
+{
+    if (options_.Streaming)
+    {
+        streamingOutputStream_ = std::make_unique<TraceOutputStream>(outputFile_);
+        if (!*streamingOutputStream_) {
+            return AnalysisControl::FAILURE;
+        }
+
+        streamingWriter_ = CreateTraceWriter(outputFile_, *streamingOutputStream_, *hierarchy_, options_);
+        streamingWriter_->BeginTrace();
+    }
+
+    return AnalysisControl::CONTINUE;
+}
+
+AnalysisControl TimeTraceGenerator::OnBeginAnalysisPass()
 {
+    // the hierarchy may take a pass beforehand that doesn't build anything (see ExecutionHierarchy::Filter::MaxEntries),
+    // so only the roots that finish in the last one count
+    finishedRoots_.clear();
+    return AnalysisControl::CONTINUE;
 }
 
 BI::AnalysisControl TimeTraceGenerator::OnStopActivity(const BI::EventStack& eventStack)
 {
     MatchEventInMemberFunction(eventStack.Back(), this, &TimeTraceGenerator::ProcessActivity);
 
+    // a single activity in the stack means a root has finished
+    if (options_.Streaming && eventStack.Size() == 1)
+    {
+        finishedRoots_.insert(eventStack.Back().EventInstanceId());
+
+        if (!StreamFinishedRoots(false)) {
+            return AnalysisControl::FAILURE;
+        }
+    }
+
     return AnalysisControl::CONTINUE;
 }
 
 AnalysisControl TimeTraceGenerator::OnEndAnalysis()
 {
+    if (options_.Streaming) {
+        return FinishStreaming() && longNameWriter_.Close() ? AnalysisControl::CONTINUE : AnalysisControl::FAILURE;
+    }
+
+    hierarchy_->Finalize();
     remappings_.Calculate(hierarchy_);
 
-    std::ofstream outputStream(outputFile_);
-    if (!outputStream) {
+    if (!(options_.IsSplit() ? ExportSplit() : Export()) || !longNameWriter_.Close()) {
         return AnalysisControl::FAILURE;
     }
 
-    ExportTo(outputStream);
-    outputStream.close();
-
     return AnalysisControl::CONTINUE;
 }
 
@@ -131,24 +241,416 @@ void TimeTraceGenerator::CalculateChildrenOffsets(const Activity& activity)
     // may've been filtered out!
     if (entry != nullptr)
     {
-        remappings_.CalculateChildrenLocalThreadData(entry);
+        remappings_.CalculateChildrenLocalThreadData(hierarchy_, entry);
+    }
+}
+
+bool TimeTraceGenerator::StreamFinishedRoots(bool includeUnfinished)
+{
+    // roots get written in the same order as a regular export would, so a finished root waits for any root
+    // that started before it: that's what lets ProcessId remappings be calculated one root at a time
+    const ExecutionHierarchy::TRoots& roots = hierarchy_->GetRoots();
+    while (!roots.empty() && (finishedRoots_.erase(roots.front()->Id) > 0 || includeUnfinished))
+    {
+        const ExecutionHierarchy::Entry* root = roots.front();
+
+        streamingLayout_.Clear();
+        hierarchy_->Flatten(root, streamingLayout_);
+        remappings_.CalculateForRoot(hierarchy_, streamingLayout_);
+
+        // only the lanes this root got named get written, so each name goes out once
+        WriteLaneNames(*streamingWriter_);
+        remappings_.ClearNames();
+
+        AddEntries(streamingLayout_, 0, streamingLayout_.Size(), nullptr, *streamingWriter_, writeState_);
+
+        remappings_.Forget(streamingLayout_);
+        hierarchy_->ReleaseRoot(root);
+    }
+
+    return !streamingOutputStream_->fail();
+}
+
+bool TimeTraceGenerator::FinishStreaming()
+{
+    // roots that never finished (i.e. the trace got cut) still get written, as they would in a regular export
+    bool succeeded = StreamFinishedRoots(true);
+
+    streamingWriter_->EndTrace();
+    streamingWriter_.reset();
+
+    return streamingOutputStream_->Close() && succeeded;
+}
+
+TimeTraceGenerator::TimeWindow TimeTraceGenerator::GetTraceWindow() const
+{
+    const ExecutionHierarchy::TRoots& roots = hierarchy_->GetRoots();
+    if (roots.empty()) {
+        return TimeWindow{};
+    }
+
+    TimeWindow window{ roots.front()->StartTimestamp, roots.front()->StopTimestamp };
+    for (const ExecutionHierarchy::Entry* root : roots)
+    {
+        window.Start = std::min(window.Start, root->StartTimestamp);
+        window.Stop = std::max(window.Stop, root->StopTimestamp);
+    }
+
+    // windows don't include their stop timestamp, so make room for events at the very end of the trace
+    window.Stop += 1;
+
+    return window;
+}
+
+std::vector<TimeTraceGenerator::TimeWindow> TimeTraceGenerator::CalculateSplitWindows() const
+{
+    TimeWindow trace = GetTraceWindow();
+    std::vector<long long> boundaries{ trace.Start };
+
+    if (options_.SplitWindow.count() > 0)
+    {
+        long long splitWindow = hierarchy_->GetTickConverter().FromNanoseconds(options_.SplitWindow);
+
+        for (long long boundary = trace.Start + splitWindow; boundary < trace.Stop; boundary += splitWindow) {
+            boundaries.push_back(boundary);
+        }
+    }
+    else
+    {
+        // cut wherever the accumulated size of the events that start after the previous cut reaches the target
+        long long bucketDuration = std::max((trace.Stop - trace.Start) / SizeEstimationBucketCount, 1LL);
+
+        std::vector<unsigned long long> bucketSizes(SizeEstimationBucketCount, 0ULL);
+
+        const ExecutionHierarchy::Layout& layout = hierarchy_->GetLayout();
+        for (size_t position = 0; position < layout.Size(); ++position)
+        {
+            long long sinceTraceStart = std::max(layout.StartTimestamps[position] - trace.Start, 0LL);
+            size_t bucket = std::min(static_cast<size_t>(sinceTraceStart / bucketDuration), bucketSizes.size() - 1);
+
+            bucketSizes[bucket] += EstimateSize(*hierarchy_, hierarchy_->GetEntryAt(layout.EntryIndices[position]), layout.SubtreeSizes[position] > 1);
+        }
+
+        unsigned long long size = 0ULL;
+        for (int i = 0; i < SizeEstimationBucketCount; ++i)
+        {
+            if (size > 0 && size + bucketSizes[i] > options_.SplitSizeInBytes)
+            {
+                boundaries.push_back(trace.Start + bucketDuration * i);
+                size = 0ULL;
+            }
+
+            size += bucketSizes[i];
+        }
+    }
+
+    boundaries.push_back(trace.Stop);
+
+    std::vector<TimeWindow> windows;
+    for (size_t i = 0; i + 1 < boundaries.size(); ++i)
+    {
+        windows.push_back({ boundaries[i], boundaries[i + 1] });
+    }
+
+    return windows;
+}
+
+bool TimeTraceGenerator::Export()
+{
+    // an all-encompassing window never cuts anything
+    TimeWindow everything{ std::numeric_limits<long long>::min(), std::numeric_limits<long long>::max() };
+
+    return ExportTo(outputFile_, everything);
+}
+
+bool TimeTraceGenerator::ExportSplit()
+{
+    std::vector<TimeWindow> windows = CalculateSplitWindows();
+
+    for (size_t i = 0; i < windows.size(); ++i)
+    {
+        if (!ExportTo(GetChunkFile(outputFile_, i), windows[i])) {
+            return false;
+        }
+    }
+
+    // shares the lanes of the split files, so what's in the overview shows up in the same place there
+    if (options_.Overview)
+    {
+        TimeWindow overview{ std::numeric_limits<long long>::min(), std::numeric_limits<long long>::max(), OverviewDepthCount };
+        if (!ExportTo(outputFile_, overview)) {
+            return false;
+        }
+    }
+
+    return ExportIndex(windows);
+}
+
+bool TimeTraceGenerator::ExportTo(const std::filesystem::path& outputFile, const TimeWindow& window)
+{
+    TraceOutputStream outputStream{ outputFile };
+    if (!outputStream) {
+        return false;
+    }
+
+    std::unique_ptr<TraceWriter> writer = CreateTraceWriter(outputFile, outputStream, *hierarchy_, options_);
+    writer->BeginTrace();
+    WriteLaneNames(*writer);
+
+    const ExecutionHierarchy::Layout& layout = hierarchy_->GetLayout();
+    if (!AddEntriesInParallel(layout, &window, *writer)) {
+        AddEntries(layout, 0, layout.Size(), &window, *writer, writeState_);
+    }
+
+    writer->EndTrace();
+    writer.reset();
+
+    writeState_.ClippedEntries.clear();
+
+    return outputStream.Close();
+}
+
+void TimeTraceGenerator::WriteLaneNames(TraceWriter& writer) const
+{
+    for (const PackedProcessThreadRemapping::ProcessName& processName : remappings_.GetProcessNames()) {
+        writer.WriteProcessName(processName.ProcessId, processName.Name);
+    }
+
+    for (const PackedProcessThreadRemapping::ThreadName& threadName : remappings_.GetThreadNames()) {
+        writer.WriteThreadName(threadName.ProcessId, threadName.ThreadId, threadName.Name);
+    }
+}
+
+bool TimeTraceGenerator::ExportIndex(const std::vector<TimeWindow>& windows) const
+{
+    std::ofstream outputStream{ GetIndexFile(outputFile_), std::ios::out | std::ios::binary | std::ios::trunc };
+    if (!outputStream) {
+        return false;
+    }
+
+    // chunk files sit next to the index, and their time ranges use the same clock as the events' "ts"
+    const TickConverter& tickConverter = hierarchy_->GetTickConverter();
+    long long origin = options_.CompactJson && !IsPerfettoTrace(outputFile_) ? tickConverter.GetOrigin() : 0LL;
+
+    // file names can hold quotes and backslashes just like anything else
+    std::string buffer = "{\n";
+    if (options_.Overview)
+    {
+        buffer.append("\"overview\": ");
+        JsonTraceWriter::AppendEscapedString(buffer, outputFile_.filename().u8string());
+        buffer.append(",\n");
+    }
+
+    buffer.append("\"chunks\": [");
+    for (size_t i = 0; i < windows.size(); ++i)
+    {
+        buffer.append(i == 0 ? "\n{\"file\":" : ",\n{\"file\":");
+        JsonTraceWriter::AppendEscapedString(buffer, GetChunkFile(outputFile_, i).filename().u8string());
+        buffer.append(",\"start\":");
+        buffer.append(std::to_string(ToMicroseconds(tickConverter, windows[i].Start - origin)));
+        buffer.append(",\"end\":");
+        buffer.append(std::to_string(ToMicroseconds(tickConverter, windows[i].Stop - origin)));
+        buffer.push_back('}');
+    }
+    buffer.append("\n]\n}\n");
+
+    outputStream.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+
+    outputStream.close();
+    return !outputStream.fail();
+}
+
+void TimeTraceGenerator::AddEntries(const ExecutionHierarchy::Layout& layout, size_t begin, size_t end, const TimeWindow* window,
+                                    TraceWriter& writer, WriteState& state) const
+{
+    std::vector<OpenEntry>& openEntries = state.OpenEntries;
+    openEntries.clear();
+
+    // entries before this position are part of a subtree that fits in the window as a whole
+    size_t containedEnd = begin;
+
+    size_t position = begin;
+    while (position < end)
+    {
+        while (!openEntries.empty() && openEntries.back().End <= position)
+        {
+            const OpenEntry& openEntry = openEntries.back();
+            writer.WriteEndEvent(openEntry.Entry, openEntry.ProcessId, openEntry.ThreadId);
+            openEntries.pop_back();
+        }
+
+        const size_t subtreeEnd = position + layout.SubtreeSizes[position];
+        const ExecutionHierarchy::Entry* entry = hierarchy_->GetEntryAt(layout.EntryIndices[position]);
+        const PackedProcessThreadRemapping::Remap& remap = remappings_.GetRemapAt(position);
+        bool hasChildren = subtreeEnd > position + 1;
+
+        if (window != nullptr && position >= containedEnd)
+        {
+            if (!window->Overlaps(layout.StartTimestamps[position], layout.StopTimestamps[position]))
+            {
+                position = subtreeEnd;
+                continue;
+            }
+
+            if (window->Contains(layout.StartTimestamps[position], layout.StopTimestamps[position])) {
+                containedEnd = subtreeEnd;
+            }
+            else
+            {
+                // the entry crosses a boundary: write a copy that gets cut at the boundary, and re-opened in the next window,
+                // so it still wraps whatever part of its children falls in this window
+                ExecutionHierarchy::Entry& clippedEntry = state.ClippedEntries.emplace_back();
+                clippedEntry.Id = entry->Id;
+                clippedEntry.ProcessId = entry->ProcessId;
+                clippedEntry.ThreadId = entry->ThreadId;
+                clippedEntry.StartTimestamp = std::max(entry->StartTimestamp, window->Start);
+                clippedEntry.StopTimestamp = std::min(entry->StopTimestamp, window->Stop);
+                clippedEntry.Name = entry->Name;
+                clippedEntry.SymbolName = entry->SymbolName;
+                clippedEntry.Properties = entry->Properties;
+                clippedEntry.PropertyLists = entry->PropertyLists;
+
+                hasChildren = false;
+                for (size_t child = position + 1; child < subtreeEnd && !hasChildren; child += layout.SubtreeSizes[child]) {
+                    hasChildren = window->Overlaps(layout.StartTimestamps[child], layout.StopTimestamps[child]);
+                }
+
+                entry = &clippedEntry;
+            }
+        }
+
+        // the deepest level the window keeps ends here (any entry open is an ancestor of this one)
+        if (window != nullptr && window->DepthCount > 0 && openEntries.size() + 1 >= window->DepthCount) {
+            hasChildren = false;
+        }
+
+        if (!hasChildren)
+        {
+            writer.WriteCompleteEvent(entry, remap.ProcessId, remap.ThreadId);
+            position = subtreeEnd;
+        }
+        else
+        {
+            // the End event gets written once we're past the subtree
+            writer.WriteBeginEvent(entry, remap.ProcessId, remap.ThreadId);
+            openEntries.push_back({ subtreeEnd, entry, remap.ProcessId, remap.ThreadId });
+            ++position;
+        }
+    }
+
+    while (!openEntries.empty())
+    {
+        const OpenEntry& openEntry = openEntries.back();
+        writer.WriteEndEvent(openEntry.Entry, openEntry.ProcessId, openEntry.ThreadId);
+        openEntries.pop_back();
     }
 }
 
-void TimeTraceGenerator::ExportTo(std::ostream& outputStream) const
+bool TimeTraceGenerator::AddEntriesInParallel(const ExecutionHierarchy::Layout& layout, const TimeWindow* window, TraceWriter& writer) const
 {
-    nlohmann::json json = nlohmann::json::object();
+    unsigned int workerCount = options_.ExportThreadCount > 0 ? options_.ExportThreadCount : std::thread::hardware_concurrency();
+    if (workerCount < 2 || layout.Roots.size() < 2) {
+        return false;
+    }
 
-    // add hierarchy
-    nlohmann::json traceEvents = nlohmann::json::array();
-    for (const ExecutionHierarchy::Entry* root : hierarchy_->GetRoots())
+    // roots get grouped in consecutive batches, big enough to be worth handing over to another thread
+    std::vector<std::pair<size_t, size_t>> batches;
+    for (size_t i = 0; i < layout.Roots.size(); ++i)
     {
-        AddEntry(root, traceEvents, remappings_);
+        size_t rootEnd = layout.Roots[i] + layout.SubtreeSizes[layout.Roots[i]];
+        if (!batches.empty() && batches.back().second - batches.back().first < MinBatchEntryCount) {
+            batches.back().second = rootEnd;
+        }
+        else {
+            batches.push_back({ layout.Roots[i], rootEnd });
+        }
     }
-    json["traceEvents"] = traceEvents;
 
-    // although "ms" is the default time unit, make it explicit ("ms" means "microseconds")
-    json["displayTimeUnit"] = "ms";
+    if (batches.size() < 2) {
+        return false;
+    }
+
+    // each slot holds a batch from the moment a worker starts writing it until it gets appended to the output, so
+    // batches get written at most a few slots ahead of the output (which bounds memory usage)
+    struct Slot
+    {
+        std::unique_ptr<TraceWriter> Writer;
+        WriteState State;
+        bool IsWritten = false;
+    };
+
+    workerCount = static_cast<unsigned int>(std::min<size_t>(workerCount, batches.size()));
+    std::vector<Slot> slots(workerCount * SlotsPerWorker);
+    for (Slot& slot : slots)
+    {
+        slot.Writer = writer.CreateFragmentWriter();
+        if (slot.Writer == nullptr) {
+            return false;
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t nextBatch = 0;
+    size_t appendedBatches = 0;
+
+    auto work = [this, &layout, window, &batches, &slots, &mutex, &condition, &nextBatch, &appendedBatches]()
+    {
+        while (true)
+        {
+            size_t batch = 0;
+
+            {
+                std::unique_lock<std::mutex> lock{ mutex };
+                condition.wait(lock, [&]() { return nextBatch == batches.size() || nextBatch < appendedBatches + slots.size(); });
+
+                if (nextBatch == batches.size()) {
+                    return;
+                }
+
+                batch = nextBatch++;
+            }
+
+            Slot& slot = slots[batch % slots.size()];
+            AddEntries(layout, batches[batch].first, batches[batch].second, window, *slot.Writer, slot.State);
+
+            {
+                std::lock_guard<std::mutex> lock{ mutex };
+                slot.IsWritten = true;
+            }
+            condition.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int worker = 0; worker < workerCount; ++worker) {
+        workers.emplace_back(work);
+    }
+
+    // meanwhile, batches get appended in order as soon as they're written
+    for (size_t batch = 0; batch < batches.size(); ++batch)
+    {
+        Slot& slot = slots[batch % slots.size()];
+
+        {
+            std::unique_lock<std::mutex> lock{ mutex };
+            condition.wait(lock, [&slot]() { return slot.IsWritten; });
+        }
+
+        writer.AppendFragment(*slot.Writer);
+        slot.State.ClippedEntries.clear();
+
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            slot.IsWritten = false;
+            ++appendedBatches;
+        }
+        condition.notify_all();
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
 
-    outputStream << std::setw(2) << json << std::endl;
+    return true;
 }
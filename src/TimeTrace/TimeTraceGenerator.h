@@ -1,35 +1,152 @@
 #pragma once
 
+#include <chrono>
+#include <deque>
 #include <filesystem>
 #include <iosfwd>
+#include <memory>
 #include <unordered_set>
+#include <vector>
 
 #include "VcperfBuildInsights.h"
 #include "TimeTrace\ExecutionHierarchy.h"
+#include "TimeTrace\LongNameWriter.h"
 #include "TimeTrace\PackedProcessThreadRemapping.h"
 
 namespace vcperf
 {
 
+class TraceOutputStream;
+class TraceWriter;
+
 class TimeTraceGenerator : public BI::IAnalyzer
 {
 public:
 
-    TimeTraceGenerator(ExecutionHierarchy* hierarchy, const std::filesystem::path& outputFile);
+    // controls how the time trace gets written
+    struct Options
+    {
+        // when any of these is set, the output gets split in several self-contained files, each covering a
+        // window of the build: either a fixed amount of time, or as much time as fits in roughly the given size
+        std::chrono::minutes SplitWindow = std::chrono::minutes(0);
+        unsigned long long SplitSizeInBytes = 0ULL;
+
+        bool IsSplit() const { return SplitWindow.count() > 0 || SplitSizeInBytes > 0; }
+
+        // when split, the output file itself gets a coarse overview of the whole build (invocations and their passes),
+        // that the index lists along with the split files, which keep all the detail
+        bool Overview = false;
+
+        // when set, each root (i.e. a compiler or linker invocation) gets written and freed as soon as it finishes,
+        // along with any root started earlier, so memory usage doesn't grow with the length of the build (splitting
+        // the output needs the whole trace, so it isn't available)
+        bool Streaming = false;
+
+        // how compiler and linker invocations get laid out in lanes (i.e. processes and threads) of the trace viewer
+        PackedProcessThreadRemapping::Strategy LaneStrategy = PackedProcessThreadRemapping::Strategy::PACKED;
+
+        // when set, .json traces only use complete events, with timestamps relative to the start of the trace
+        // (Perfetto's format is compact already)
+        bool CompactJson = false;
+
+        // when set, long property values (e.g. command lines and environment variables, which tend to repeat
+        // across invocations) get written once per file, and entries refer to them by id
+        bool ShareArgs = false;
+
+        // threads writing roots at the same time when exporting, for formats that allow it (0 means one per core)
+        unsigned int ExportThreadCount = 0U;
+
+        // passed on to the ExecutionHierarchy (see ExecutionHierarchy::Filter), as they decide what gets exported
+        bool AggregateIgnored = false;
+        unsigned int MaxIncludeDepth = 0U;
+        size_t MaxEntries = 0;
+    };
+
+    // for split outputs, i.e. "trace.json.gz" -> "trace.index.json" and "trace.003.json.gz"
+    static std::filesystem::path GetIndexFile(const std::filesystem::path& outputFile);
+    static std::filesystem::path GetChunkFile(const std::filesystem::path& outputFile, size_t chunkIndex);
+    // full names of the entries that got a shortened one, i.e. "trace.json.gz" -> "trace.names.json"
+    static std::filesystem::path GetNamesFile(const std::filesystem::path& outputFile);
+
+public:
+
+    TimeTraceGenerator(ExecutionHierarchy* hierarchy, const std::filesystem::path& outputFile, const Options& options);
+    ~TimeTraceGenerator();
 
+    BI::AnalysisControl OnBeginAnalysis() override;
+    BI::AnalysisControl OnBeginAnalysisPass() override;
     BI::AnalysisControl OnStopActivity(const BI::EventStack& eventStack) override;
     BI::AnalysisControl OnEndAnalysis() override;
 
 private:
 
+    struct TimeWindow
+    {
+        // in ticks, like the entries' timestamps
+        long long Start = 0LL;
+        long long Stop = 0LL;
+        // levels of the hierarchy that get written, roots being the first one (0 means all of them)
+        size_t DepthCount = 0;
+
+        bool Contains(long long startTimestamp, long long stopTimestamp) const;
+        bool Overlaps(long long startTimestamp, long long stopTimestamp) const;
+    };
+
+    // an entry whose End event waits for the rest of its subtree to be written
+    struct OpenEntry
+    {
+        size_t End = 0;
+        const ExecutionHierarchy::Entry* Entry = nullptr;
+        unsigned long ProcessId = 0UL;
+        unsigned long ThreadId = 0UL;
+    };
+
+    // what writing a run of entries keeps track of, so several runs can get written at the same time
+    struct WriteState
+    {
+        // copies of the entries that cross a window's boundaries, trimmed to fit in it
+        std::deque<ExecutionHierarchy::Entry> ClippedEntries;
+        std::vector<OpenEntry> OpenEntries;
+    };
+
     void ProcessActivity(const A::Activity& activity);
 
     void CalculateChildrenOffsets(const A::Activity& activity);
-    void ExportTo(std::ostream& outputStream) const;
+
+    bool StreamFinishedRoots(bool includeUnfinished);
+    bool FinishStreaming();
+
+    TimeWindow GetTraceWindow() const;
+    std::vector<TimeWindow> CalculateSplitWindows() const;
+
+    bool Export();
+    bool ExportSplit();
+    bool ExportTo(const std::filesystem::path& outputFile, const TimeWindow& window);
+    bool ExportIndex(const std::vector<TimeWindow>& windows) const;
+
+    void WriteLaneNames(TraceWriter& writer) const;
+
+    // writes the layout's entries in [begin, end) in order, cutting those that cross the window's boundaries, if any
+    void AddEntries(const ExecutionHierarchy::Layout& layout, size_t begin, size_t end, const TimeWindow* window,
+                    TraceWriter& writer, WriteState& state) const;
+    // same, for the whole layout, but with batches of roots written on several threads (false when the writer can't)
+    bool AddEntriesInParallel(const ExecutionHierarchy::Layout& layout, const TimeWindow* window, TraceWriter& writer) const;
 
     ExecutionHierarchy* hierarchy_;
     std::filesystem::path outputFile_;
+    Options options_;
     PackedProcessThreadRemapping remappings_;
+
+    WriteState writeState_;
+
+    // when streaming, the output stays open for the whole analysis, and finished roots wait here for their turn
+    std::unique_ptr<TraceOutputStream> streamingOutputStream_;
+    std::unique_ptr<TraceWriter> streamingWriter_;
+    ExecutionHierarchy::Layout streamingLayout_;
+    std::unordered_set<unsigned long long> finishedRoots_;
+
+    // full names get written as the hierarchy shortens them, whether streaming or not
+    LongNameWriter longNameWriter_;
 };
 
 } // namespace vcperf
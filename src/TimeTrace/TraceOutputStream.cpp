@@ -0,0 +1,421 @@
+#include "TraceOutputStream.h"
+
+#include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+#include <zstd.h>
+
+using namespace vcperf;
+
+namespace
+{
+    // size of every chunk handed over to the compression thread, and how many of them can be in
+    // flight before the producer has to wait (bounds memory usage when disk is slower than analysis)
+    constexpr size_t ChunkSize = 1 << 20;
+    constexpr size_t MaxChunks = 4;
+
+    class Compressor
+    {
+    public:
+
+        virtual ~Compressor() = default;
+
+        // appends the compressed representation of data to output, finish must be set for the last call
+        virtual bool Compress(const char* data, size_t size, bool finish, std::string& output) = 0;
+    };
+
+    class GzipCompressor : public Compressor
+    {
+    public:
+
+        GzipCompressor() :
+            stream_{},
+            isInitialized_{false}
+        {
+            // adding 16 to the window bits gets us a gzip header and trailer instead of a zlib one
+            isInitialized_ = deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+
+        ~GzipCompressor()
+        {
+            if (isInitialized_) {
+                deflateEnd(&stream_);
+            }
+        }
+
+        bool Compress(const char* data, size_t size, bool finish, std::string& output) override
+        {
+            if (!isInitialized_) {
+                return false;
+            }
+
+            // chunks are small enough to always fit in uInt
+            stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            stream_.avail_in = static_cast<uInt>(size);
+
+            int result = Z_OK;
+            do
+            {
+                size_t offset = output.size();
+                output.resize(offset + ChunkSize);
+
+                stream_.next_out = reinterpret_cast<Bytef*>(&output[offset]);
+                stream_.avail_out = static_cast<uInt>(ChunkSize);
+                result = deflate(&stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+                output.resize(offset + ChunkSize - stream_.avail_out);
+
+                if (result == Z_STREAM_ERROR) {
+                    return false;
+                }
+            }
+            while (stream_.avail_out == 0 || (finish && result != Z_STREAM_END));
+
+            assert(stream_.avail_in == 0);
+            return true;
+        }
+
+    private:
+
+        z_stream stream_;
+        bool isInitialized_;
+    };
+
+    class ZstdCompressor : public Compressor
+    {
+    public:
+
+        ZstdCompressor() :
+            context_{ZSTD_createCCtx()}
+        {
+            if (context_ != nullptr) {
+                ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, 3);
+            }
+        }
+
+        ~ZstdCompressor()
+        {
+            ZSTD_freeCCtx(context_);
+        }
+
+        bool Compress(const char* data, size_t size, bool finish, std::string& output) override
+        {
+            if (context_ == nullptr) {
+                return false;
+            }
+
+            ZSTD_inBuffer input{ data, size, 0 };
+            size_t remaining = 0;
+            do
+            {
+                size_t offset = output.size();
+                output.resize(offset + ChunkSize);
+
+                ZSTD_outBuffer out{ &output[offset], ChunkSize, 0 };
+                remaining = ZSTD_compressStream2(context_, &out, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+                output.resize(offset + out.pos);
+
+                if (ZSTD_isError(remaining)) {
+                    return false;
+                }
+            }
+            while (finish ? remaining != 0 : input.pos != input.size);
+
+            return true;
+        }
+
+    private:
+
+        ZSTD_CCtx* context_;
+    };
+
+    std::unique_ptr<Compressor> CreateCompressor(TraceOutputStream::Compression compression)
+    {
+        switch (compression)
+        {
+        case TraceOutputStream::Compression::GZIP:
+            return std::make_unique<GzipCompressor>();
+
+        case TraceOutputStream::Compression::ZSTD:
+            return std::make_unique<ZstdCompressor>();
+
+        default:
+            return nullptr;
+        }
+    }
+
+}  // anonymous namespace
+
+// buffers whatever gets written in fixed-size chunks, which a worker thread compresses and writes to disk
+class TraceOutputStream::CompressingStreamBuffer : public std::streambuf
+{
+public:
+
+    CompressingStreamBuffer(const std::filesystem::path& outputFile, Compression compression);
+    ~CompressingStreamBuffer();
+
+    bool IsOpen() const { return worker_.joinable(); }
+    bool Close();
+
+protected:
+
+    int_type overflow(int_type ch) override;
+
+private:
+
+    struct Chunk
+    {
+        std::unique_ptr<char[]> Data;
+        size_t Size = 0;
+    };
+
+    void Submit();
+    void Work();
+
+    std::ofstream file_;
+    std::unique_ptr<Compressor> compressor_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::deque<Chunk> pendingChunks_;
+    std::vector<Chunk> freeChunks_;
+    size_t allocatedChunks_;
+    bool isFinishing_;
+    bool hasFailed_;
+
+    Chunk currentChunk_;
+    std::thread worker_;
+};
+
+TraceOutputStream::CompressingStreamBuffer::CompressingStreamBuffer(const std::filesystem::path& outputFile, Compression compression) :
+    file_{outputFile, std::ios::out | std::ios::binary | std::ios::trunc},
+    compressor_{CreateCompressor(compression)},
+    mutex_{},
+    condition_{},
+    pendingChunks_{},
+    freeChunks_{},
+    allocatedChunks_{1},
+    isFinishing_{false},
+    hasFailed_{false},
+    currentChunk_{},
+    worker_{}
+{
+    if (!file_ || !compressor_) {
+        return;
+    }
+
+    currentChunk_.Data = std::make_unique<char[]>(ChunkSize);
+    setp(currentChunk_.Data.get(), currentChunk_.Data.get() + ChunkSize);
+
+    worker_ = std::thread{ &CompressingStreamBuffer::Work, this };
+}
+
+TraceOutputStream::CompressingStreamBuffer::~CompressingStreamBuffer()
+{
+    Close();
+}
+
+bool TraceOutputStream::CompressingStreamBuffer::Close()
+{
+    // never opened, or already closed
+    if (!worker_.joinable()) {
+        return isFinishing_ && !hasFailed_;
+    }
+
+    Submit();
+
+    {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        isFinishing_ = true;
+    }
+    condition_.notify_all();
+
+    worker_.join();
+    setp(nullptr, nullptr);
+
+    return !hasFailed_;
+}
+
+TraceOutputStream::CompressingStreamBuffer::int_type TraceOutputStream::CompressingStreamBuffer::overflow(int_type ch)
+{
+    Submit();
+
+    {
+        // wait for a free chunk, unless we're still allowed to allocate a new one
+        std::unique_lock<std::mutex> lock{ mutex_ };
+        condition_.wait(lock, [this]() { return !freeChunks_.empty() || allocatedChunks_ < MaxChunks || hasFailed_; });
+
+        if (hasFailed_) {
+            return traits_type::eof();
+        }
+
+        if (!freeChunks_.empty())
+        {
+            currentChunk_ = std::move(freeChunks_.back());
+            freeChunks_.pop_back();
+        }
+        else
+        {
+            currentChunk_.Data = std::make_unique<char[]>(ChunkSize);
+            ++allocatedChunks_;
+        }
+    }
+
+    setp(currentChunk_.Data.get(), currentChunk_.Data.get() + ChunkSize);
+
+    if (!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(ch);
+}
+
+void TraceOutputStream::CompressingStreamBuffer::Submit()
+{
+    if (currentChunk_.Data == nullptr) {
+        return;
+    }
+
+    currentChunk_.Size = static_cast<size_t>(pptr() - pbase());
+    setp(nullptr, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        pendingChunks_.push_back(std::move(currentChunk_));
+    }
+    condition_.notify_all();
+
+    currentChunk_ = Chunk{};
+}
+
+void TraceOutputStream::CompressingStreamBuffer::Work()
+{
+    std::string compressed;
+    compressed.reserve(ChunkSize);
+
+    while (true)
+    {
+        Chunk chunk;
+        bool finish = false;
+
+        {
+            std::unique_lock<std::mutex> lock{ mutex_ };
+            condition_.wait(lock, [this]() { return !pendingChunks_.empty() || isFinishing_; });
+
+            if (!pendingChunks_.empty())
+            {
+                chunk = std::move(pendingChunks_.front());
+                pendingChunks_.pop_front();
+            }
+            else {
+                finish = true;
+            }
+        }
+
+        // after a failure, keep consuming chunks so the producer never blocks, but stop doing any work
+        bool succeeded = !hasFailed_;
+        if (succeeded)
+        {
+            compressed.clear();
+            succeeded = compressor_->Compress(chunk.Data.get(), chunk.Size, finish, compressed) &&
+                        file_.write(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+        }
+
+        if (finish)
+        {
+            file_.close();
+            succeeded = succeeded && !file_.fail();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            hasFailed_ = hasFailed_ || !succeeded;
+
+            if (chunk.Data != nullptr) {
+                freeChunks_.push_back(std::move(chunk));
+            }
+        }
+        condition_.notify_all();
+
+        if (finish) {
+            break;
+        }
+    }
+}
+
+TraceOutputStream::Compression TraceOutputStream::GetCompression(const std::filesystem::path& outputFile)
+{
+    std::filesystem::path extension = outputFile.extension();
+
+    if (extension == L".gz") {
+        return Compression::GZIP;
+    }
+
+    if (extension == L".zst") {
+        return Compression::ZSTD;
+    }
+
+    return Compression::NONE;
+}
+
+std::filesystem::path TraceOutputStream::RemoveCompressionExtension(const std::filesystem::path& outputFile)
+{
+    std::filesystem::path uncompressedOutputFile = outputFile;
+    if (GetCompression(outputFile) != Compression::NONE) {
+        uncompressedOutputFile.replace_extension();
+    }
+
+    return uncompressedOutputFile;
+}
+
+TraceOutputStream::TraceOutputStream(const std::filesystem::path& outputFile) :
+    std::ostream{nullptr},
+    fileBuffer_{},
+    compressingBuffer_{}
+{
+    Compression compression = GetCompression(outputFile);
+
+    if (compression == Compression::NONE)
+    {
+        fileBuffer_ = std::make_unique<std::filebuf>();
+        if (fileBuffer_->open(outputFile, std::ios::out | std::ios::binary | std::ios::trunc)) {
+            rdbuf(fileBuffer_.get());
+        }
+    }
+    else
+    {
+        compressingBuffer_ = std::make_unique<CompressingStreamBuffer>(outputFile, compression);
+        if (compressingBuffer_->IsOpen()) {
+            rdbuf(compressingBuffer_.get());
+        }
+    }
+
+    // without a buffer we're in bad state, so callers can check for errors as they would with a std::ofstream
+}
+
+TraceOutputStream::~TraceOutputStream()
+{
+}
+
+bool TraceOutputStream::Close()
+{
+    bool succeeded = good();
+
+    if (fileBuffer_ != nullptr && fileBuffer_->is_open()) {
+        succeeded = fileBuffer_->close() != nullptr && succeeded;
+    }
+
+    if (compressingBuffer_ != nullptr) {
+        succeeded = compressingBuffer_->Close() && succeeded;
+    }
+
+    return succeeded;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <ostream>
+
+namespace vcperf
+{
+
+// output file for time traces: when the file name ends in .gz or .zst, everything written into the stream
+// gets compressed on a background thread on its way to disk
+class TraceOutputStream : public std::ostream
+{
+public:
+
+    enum class Compression
+    {
+        NONE,
+        GZIP,
+        ZSTD
+    };
+
+    static Compression GetCompression(const std::filesystem::path& outputFile);
+
+    // strips the compression extension, if any (i.e. "trace.json.gz" -> "trace.json")
+    static std::filesystem::path RemoveCompressionExtension(const std::filesystem::path& outputFile);
+
+public:
+
+    TraceOutputStream(const std::filesystem::path& outputFile);
+    ~TraceOutputStream();
+
+    // flushes everything still pending and closes the file, returns false if anything failed along the way
+    bool Close();
+
+private:
+
+    class CompressingStreamBuffer;
+
+    std::unique_ptr<std::filebuf> fileBuffer_;
+    std::unique_ptr<CompressingStreamBuffer> compressingBuffer_;
+};
+
+} // namespace vcperf
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <string_view>
+
+#include "TimeTrace\ExecutionHierarchy.h"
+
+namespace vcperf
+{
+
+// receives the hierarchy's entries, in depth-first order, and serializes them into some trace format
+class TraceWriter
+{
+public:
+
+    virtual ~TraceWriter() = default;
+
+    virtual void BeginTrace() = 0;
+    virtual void EndTrace() = 0;
+
+    // metadata describing what a lane stands for, written before any of its events
+    virtual void WriteProcessName(unsigned long processId, std::string_view name) = 0;
+    virtual void WriteThreadName(unsigned long processId, unsigned long threadId, std::string_view name) = 0;
+
+    // used for entries with children: the Begin/End pair wraps the events of the whole subhierarchy
+    virtual void WriteBeginEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) = 0;
+    virtual void WriteEndEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) = 0;
+
+    // used for leaves
+    virtual void WriteCompleteEvent(const ExecutionHierarchy::Entry* entry, unsigned long processId, unsigned long threadId) = 0;
+
+    // formats whose events don't depend on what got written before them can have whole roots written on other threads:
+    // a fragment writer keeps its events in memory (and can be used from any thread) until they get appended, in order,
+    // to the writer it came from (nullptr when not supported)
+    virtual std::unique_ptr<TraceWriter> CreateFragmentWriter() const { return nullptr; }
+    virtual void AppendFragment(TraceWriter& fragment) {}
+};
+
+} // namespace vcperf
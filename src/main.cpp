@@ -2,8 +2,14 @@
 #include <filesystem>
 #include <iostream>
 #include <cwctype>
+#include <cwchar>
+#include <algorithm>
+#include <initializer_list>
+#include <string>
+#include <string_view>
 
 #include "Commands.h"
+#include "TimeTrace\TraceOutputStream.h"
 
 #include "VcperfBuildInsights.h"
 
@@ -43,10 +49,78 @@ bool CheckCommand(std::wstring arg, const wchar_t* value)
             ||  std::equal(begin(arg), end(arg), begin(hyphen), end(hyphen), ciCompare);
 }
 
-bool ValidateFile(const std::filesystem::path& file, bool isInput, const std::wstring& extension)
+// for options that take a value, e.g. /splitminutes:10
+bool CheckCommandWithValue(const std::wstring& arg, const wchar_t* value, unsigned long long& parsedValue, bool& isValid)
 {
-    if (file.extension() != extension) {
-        std::wcout << L"ERROR: Your " << (isInput ? L"input" : L"output") << L" file must have the " << extension << L" extension." << std::endl;
+    size_t separator = arg.find(L':');
+    if (separator == std::wstring::npos || !CheckCommand(arg.substr(0, separator), value)) {
+        return false;
+    }
+
+    std::wstring number = arg.substr(separator + 1);
+    wchar_t* end = nullptr;
+    parsedValue = std::wcstoull(number.c_str(), &end, 10);
+
+    isValid = !number.empty() && std::iswdigit(number[0]) && *end == L'\0' && parsedValue > 0;
+    if (!isValid) {
+        std::wcout << L"ERROR: /" << value << L" requires a positive number, e.g. /" << value << L":10." << std::endl;
+    }
+
+    return true;
+}
+
+// for options that pick one of a few values, e.g. /lanes:compact
+bool CheckCommandWithChoice(const std::wstring& arg, const wchar_t* value, std::initializer_list<const wchar_t*> choices,
+                            size_t& choiceIndex, bool& isValid)
+{
+    size_t separator = arg.find(L':');
+    if (separator == std::wstring::npos || !CheckCommand(arg.substr(0, separator), value)) {
+        return false;
+    }
+
+    auto ciCompare = [](wchar_t c1, wchar_t c2) { return std::towupper(c1) == std::towupper(c2); };
+
+    std::wstring choice = arg.substr(separator + 1);
+    choiceIndex = 0;
+    for (const wchar_t* validChoice : choices)
+    {
+        std::wstring_view validChoiceView{ validChoice };
+        if (std::equal(begin(choice), end(choice), begin(validChoiceView), end(validChoiceView), ciCompare))
+        {
+            isValid = true;
+            return true;
+        }
+
+        ++choiceIndex;
+    }
+
+    isValid = false;
+    std::wcout << L"ERROR: /" << value << L" must be one of ";
+    for (auto it = choices.begin(); it != choices.end(); ++it)
+    {
+        if (it != choices.begin()) {
+            std::wcout << (it + 1 == choices.end() ? L" or " : L", ");
+        }
+        std::wcout << L"/" << value << L":" << *it;
+    }
+    std::wcout << L"." << std::endl;
+
+    return true;
+}
+
+bool ValidateFile(const std::filesystem::path& file, bool isInput, std::initializer_list<const wchar_t*> extensions)
+{
+    if (std::find(extensions.begin(), extensions.end(), file.extension()) == extensions.end())
+    {
+        std::wcout << L"ERROR: Your " << (isInput ? L"input" : L"output") << L" file must have the ";
+        for (auto it = extensions.begin(); it != extensions.end(); ++it)
+        {
+            if (it != extensions.begin()) {
+                std::wcout << (it + 1 == extensions.end() ? L" or " : L", ");
+            }
+            std::wcout << *it;
+        }
+        std::wcout << L" extension." << std::endl;
         return false;
     }
 
@@ -86,11 +160,14 @@ StartSubCommand CheckStartSubCommands(const wchar_t* arg)
 void PrintStopOrAnalyzeCommandLineHint(const wchar_t* command, const wchar_t* sessionOrInputHelp)
 {
     std::wcout << L"vcperf.exe " << command << " [/templates] " << sessionOrInputHelp << " outputFile.etl" << std::endl;
-    std::wcout << L"vcperf.exe " << command << " [/templates] " << sessionOrInputHelp << " /timetrace outputFile.json" << std::endl;
+    std::wcout << L"vcperf.exe " << command << " [/templates] " << sessionOrInputHelp << " /timetrace [/lanes:packed|compact|stable] [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/compactjson] [/sharedargs] [/stream | /splitminutes:N | /splitmb:N [/overview]] outputFile.json[.gz|.zst]" << std::endl;
+    std::wcout << L"vcperf.exe " << command << " [/templates] " << sessionOrInputHelp << " /timetrace [/lanes:packed|compact|stable] [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/sharedargs] [/stream | /splitminutes:N | /splitmb:N [/overview]] outputFile.perfetto-trace[.gz|.zst]" << std::endl;
+    std::wcout << L"vcperf.exe " << command << " [/templates] " << sessionOrInputHelp << " /timetrace [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/stream] outputFile.folded[.gz|.zst]" << std::endl;
 }
 
 int ParseStopOrAnalyze(int argc, wchar_t* argv[], const wchar_t* command, const wchar_t* sessionOrInputHelp,
-    std::wstring& firstArg, std::wstring& outputFile, bool& analyzeTemplates, bool& generateTimeTrace)
+    std::wstring& firstArg, std::wstring& outputFile, bool& analyzeTemplates, bool& generateTimeTrace,
+    TimeTraceGenerator::Options& timeTraceOptions)
 {
     if (argc < 4)
     {
@@ -102,6 +179,7 @@ int ParseStopOrAnalyze(int argc, wchar_t* argv[], const wchar_t* command, const
 
     analyzeTemplates = false;
     generateTimeTrace = false;
+    timeTraceOptions = TimeTraceGenerator::Options{};
 
     // options prior to input file
 
@@ -134,6 +212,95 @@ int ParseStopOrAnalyze(int argc, wchar_t* argv[], const wchar_t* command, const
 
         generateTimeTrace = true;
         arg = argv[curArgc++];
+
+        // time trace options, only one way of splitting the output at a time, and no splitting when streaming
+        unsigned long long value = 0ULL;
+        size_t choiceIndex = 0;
+        bool isValid = false;
+        while (curArgc < argc)
+        {
+            if (CheckCommand(arg, L"stream"))
+            {
+                timeTraceOptions.Streaming = true;
+                isValid = true;
+            }
+            else if (CheckCommand(arg, L"compactjson"))
+            {
+                timeTraceOptions.CompactJson = true;
+                isValid = true;
+            }
+            else if (CheckCommand(arg, L"sharedargs"))
+            {
+                timeTraceOptions.ShareArgs = true;
+                isValid = true;
+            }
+            else if (CheckCommand(arg, L"aggregate"))
+            {
+                timeTraceOptions.AggregateIgnored = true;
+                isValid = true;
+            }
+            else if (CheckCommandWithValue(arg, L"maxincludedepth", value, isValid)) {
+                timeTraceOptions.MaxIncludeDepth = value < 0xFFFFFFFFULL ? static_cast<unsigned int>(value) : 0xFFFFFFFFU;
+            }
+            else if (CheckCommandWithValue(arg, L"maxevents", value, isValid)) {
+                timeTraceOptions.MaxEntries = static_cast<size_t>(value);
+            }
+            else if (CheckCommandWithChoice(arg, L"lanes", { L"packed", L"compact", L"stable" }, choiceIndex, isValid))
+            {
+                const PackedProcessThreadRemapping::Strategy strategies[] = {
+                    PackedProcessThreadRemapping::Strategy::PACKED,
+                    PackedProcessThreadRemapping::Strategy::COMPACT,
+                    PackedProcessThreadRemapping::Strategy::STABLE
+                };
+
+                if (isValid) {
+                    timeTraceOptions.LaneStrategy = strategies[choiceIndex];
+                }
+            }
+            else if (CheckCommandWithValue(arg, L"splitminutes", value, isValid)) {
+                timeTraceOptions.SplitWindow = std::chrono::minutes(value);
+            }
+            else if (CheckCommandWithValue(arg, L"splitmb", value, isValid)) {
+                timeTraceOptions.SplitSizeInBytes = value * 1024ULL * 1024ULL;
+            }
+            else if (CheckCommand(arg, L"overview"))
+            {
+                timeTraceOptions.Overview = true;
+                isValid = true;
+            }
+            else {
+                break;
+            }
+
+            if (!isValid)
+            {
+                PrintStopOrAnalyzeCommandLineHint(command, sessionOrInputHelp);
+                return E_FAIL;
+            }
+
+            if (timeTraceOptions.SplitWindow.count() > 0 && timeTraceOptions.SplitSizeInBytes > 0)
+            {
+                std::wcout << L"ERROR: you can only specify one of /splitminutes or /splitmb." << std::endl;
+                PrintStopOrAnalyzeCommandLineHint(command, sessionOrInputHelp);
+                return E_FAIL;
+            }
+
+            if (timeTraceOptions.Streaming && timeTraceOptions.IsSplit())
+            {
+                std::wcout << L"ERROR: /stream can't be combined with /splitminutes or /splitmb." << std::endl;
+                PrintStopOrAnalyzeCommandLineHint(command, sessionOrInputHelp);
+                return E_FAIL;
+            }
+
+            arg = argv[curArgc++];
+        }
+
+        if (timeTraceOptions.Overview && !timeTraceOptions.IsSplit())
+        {
+            std::wcout << L"ERROR: /overview requires /splitminutes or /splitmb." << std::endl;
+            PrintStopOrAnalyzeCommandLineHint(command, sessionOrInputHelp);
+            return E_FAIL;
+        }
     }
 
     if (analyzeTemplates && generateTimeTrace && argc < 6)
@@ -145,7 +312,19 @@ int ParseStopOrAnalyze(int argc, wchar_t* argv[], const wchar_t* command, const
     // output file
     outputFile = arg;
 
-    if (!ValidateFile(outputFile, false, generateTimeTrace ? L".json" : L".etl")) {
+    // time traces can optionally be compressed, which is represented as an additional extension
+    bool isValidOutputFile = generateTimeTrace ? ValidateFile(TraceOutputStream::RemoveCompressionExtension(outputFile), false, { L".json", L".perfetto-trace", L".folded" })
+                                               : ValidateFile(outputFile, false, { L".etl" });
+    if (!isValidOutputFile) {
+        PrintStopOrAnalyzeCommandLineHint(command, sessionOrInputHelp);
+        return E_FAIL;
+    }
+
+    // folded stacks merge the whole build into a single set of stacks, there's nothing to split
+    if (generateTimeTrace && timeTraceOptions.IsSplit() &&
+        TraceOutputStream::RemoveCompressionExtension(outputFile).extension() == L".folded")
+    {
+        std::wcout << L"ERROR: /splitminutes and /splitmb can't be used with .folded output files." << std::endl;
         PrintStopOrAnalyzeCommandLineHint(command, sessionOrInputHelp);
         return E_FAIL;
     }
@@ -170,10 +349,14 @@ int wmain(int argc, wchar_t* argv[])
         std::wcout << L"USAGE:" << std::endl;
         std::wcout << L"vcperf.exe /start [/noadmin] [/nocpusampling] [/level1 | /level2 | /level3] sessionName" << std::endl;
         std::wcout << L"vcperf.exe /stop [/templates] sessionName outputFile.etl" << std::endl;
-        std::wcout << L"vcperf.exe /stop [/templates] sessionName /timetrace outputFile.json" << std::endl;
+        std::wcout << L"vcperf.exe /stop [/templates] sessionName /timetrace [/lanes:packed|compact|stable] [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/compactjson] [/sharedargs] [/stream | /splitminutes:N | /splitmb:N [/overview]] outputFile.json[.gz|.zst]" << std::endl;
+        std::wcout << L"vcperf.exe /stop [/templates] sessionName /timetrace [/lanes:packed|compact|stable] [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/sharedargs] [/stream | /splitminutes:N | /splitmb:N [/overview]] outputFile.perfetto-trace[.gz|.zst]" << std::endl;
+        std::wcout << L"vcperf.exe /stop [/templates] sessionName /timetrace [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/stream] outputFile.folded[.gz|.zst]" << std::endl;
         std::wcout << L"vcperf.exe /stopnoanalyze sessionName outputRawFile.etl" << std::endl;
         std::wcout << L"vcperf.exe /analyze [/templates] inputRawFile.etl output.etl" << std::endl;
-        std::wcout << L"vcperf.exe /analyze [/templates] inputRawFile.etl /timetrace output.json" << std::endl;
+        std::wcout << L"vcperf.exe /analyze [/templates] inputRawFile.etl /timetrace [/lanes:packed|compact|stable] [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/compactjson] [/sharedargs] [/stream | /splitminutes:N | /splitmb:N [/overview]] output.json[.gz|.zst]" << std::endl;
+        std::wcout << L"vcperf.exe /analyze [/templates] inputRawFile.etl /timetrace [/lanes:packed|compact|stable] [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/sharedargs] [/stream | /splitminutes:N | /splitmb:N [/overview]] output.perfetto-trace[.gz|.zst]" << std::endl;
+        std::wcout << L"vcperf.exe /analyze [/templates] inputRawFile.etl /timetrace [/aggregate] [/maxincludedepth:N] [/maxevents:N] [/stream] output.folded[.gz|.zst]" << std::endl;
 
         std::wcout << std::endl;
 
@@ -270,12 +453,13 @@ int wmain(int argc, wchar_t* argv[])
     {
         std::wstring sessionName, outputFile;
         bool analyzeTemplates, generateTimeTrace;
+        TimeTraceGenerator::Options timeTraceOptions;
 
-        if (S_OK != ParseStopOrAnalyze(argc, argv, L"/stop", L"sessionName", sessionName, outputFile, analyzeTemplates, generateTimeTrace)) {
+        if (S_OK != ParseStopOrAnalyze(argc, argv, L"/stop", L"sessionName", sessionName, outputFile, analyzeTemplates, generateTimeTrace, timeTraceOptions)) {
             return E_FAIL;
         }
 
-        return DoStop(sessionName, outputFile, analyzeTemplates, generateTimeTrace);
+        return DoStop(sessionName, outputFile, analyzeTemplates, generateTimeTrace, timeTraceOptions);
     }
     else if (CheckCommand(argv[1], L"stopnoanalyze")) 
     {
@@ -288,7 +472,7 @@ int wmain(int argc, wchar_t* argv[])
         std::wstring sessionName = argv[2];
         std::filesystem::path outputFile = argv[3];
 
-        if (!ValidateFile(outputFile, false, L".etl")) {
+        if (!ValidateFile(outputFile, false, { L".etl" })) {
             return E_FAIL;
         }
 
@@ -298,16 +482,17 @@ int wmain(int argc, wchar_t* argv[])
     {
         std::wstring inputFile, outputFile;
         bool analyzeTemplates, generateTimeTrace;
+        TimeTraceGenerator::Options timeTraceOptions;
 
-        if (S_OK != ParseStopOrAnalyze(argc, argv, L"/analyze", L"input.etl", inputFile, outputFile, analyzeTemplates, generateTimeTrace)) {
+        if (S_OK != ParseStopOrAnalyze(argc, argv, L"/analyze", L"input.etl", inputFile, outputFile, analyzeTemplates, generateTimeTrace, timeTraceOptions)) {
             return E_FAIL;
         }
 
-        if (!ValidateFile(inputFile, true, L".etl")) {
+        if (!ValidateFile(inputFile, true, { L".etl" })) {
             return E_FAIL;
         }
 
-        return DoAnalyze(inputFile, outputFile, analyzeTemplates, generateTimeTrace);
+        return DoAnalyze(inputFile, outputFile, analyzeTemplates, generateTimeTrace, timeTraceOptions);
     }
 	else if (CheckCommand(argv[1], L"grantusercontrol"))
     {